@@ -0,0 +1,385 @@
+// Batch extraction driver: extracts descriptors for every video of a file list.
+// Videos are probed for their frame count and the longest ones are scheduled first over a pool of work-stealing workers.
+// Every output is written to a temporary file and renamed into place, then recorded in a manifest, so a restarted run skips
+// everything that was already done and tries failed videos again. Outputs are named after the flattened video path plus a hash of it.
+//
+// Usage: mpegflow_batch <file_list> <output_dir> [--threads N] [--manifest path] [--output float32|float16|uint8] [--root-normalize] [--projection path] [--io-buffer-kb N] [--read-ahead packets] [--report-every seconds]
+//
+// Each output file holds raw rows of descriptor_dim values of the requested type; manifest lines are tab-separated:
+//   done <video> <output> <patches> <descriptor_dim> <frames>
+//   failed <video> <reason>
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <deque>
+#include <set>
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <unistd.h>
+
+#include "extractor.h"
+
+using namespace std;
+
+struct Job
+{
+	string VideoPath;
+	string OutputPath;
+	int FrameCount;
+	bool Probed;
+};
+
+struct WorkQueue
+{
+	mutex lock;
+	deque<int> jobs;
+};
+
+// Every worker pops the longest job of its own queue from the front and, once it runs dry, steals from the back of the others
+struct WorkStealingScheduler
+{
+	vector<WorkQueue*> queues;
+
+	WorkStealingScheduler(vector<Job>& jobs, vector<int>& order, int numWorkers)
+	{
+		for(int i = 0; i < numWorkers; i++)
+			queues.push_back(new WorkQueue());
+		for(int i = 0; i < order.size(); i++)
+			queues[i % numWorkers]->jobs.push_back(order[i]);
+	}
+
+	~WorkStealingScheduler()
+	{
+		for(int i = 0; i < queues.size(); i++)
+			delete queues[i];
+	}
+
+	bool Next(int worker, int& job)
+	{
+		{
+			lock_guard<mutex> guard(queues[worker]->lock);
+			if(!queues[worker]->jobs.empty())
+			{
+				job = queues[worker]->jobs.front();
+				queues[worker]->jobs.pop_front();
+				return true;
+			}
+		}
+
+		for(int k = 1; k < queues.size(); k++)
+		{
+			WorkQueue* victim = queues[(worker + k) % queues.size()];
+			lock_guard<mutex> guard(victim->lock);
+			if(!victim->jobs.empty())
+			{
+				job = victim->jobs.back();
+				victim->jobs.pop_back();
+				return true;
+			}
+		}
+		return false;
+	}
+};
+
+struct Manifest
+{
+	FILE* file;
+	mutex lock;
+
+	Manifest() : file(NULL) {}
+
+	// Videos a previous run extracted; failed ones are tried again
+	static set<string> ReadCompleted(string path)
+	{
+		set<string> completed;
+		ifstream in(path.c_str());
+		string line;
+		while(getline(in, line))
+		{
+			size_t first = line.find('\t');
+			if(first == string::npos || line.compare(0, first, "done") != 0)
+				continue;
+			size_t second = line.find('\t', first + 1);
+			completed.insert(line.substr(first + 1, second == string::npos ? string::npos : second - first - 1));
+		}
+		return completed;
+	}
+
+	bool Open(string path)
+	{
+		file = fopen(path.c_str(), "a");
+		return file != NULL;
+	}
+
+	void Record(string line)
+	{
+		lock_guard<mutex> guard(lock);
+		fprintf(file, "%s\n", line.c_str());
+		fflush(file);
+		fsync(fileno(file));
+	}
+
+	~Manifest()
+	{
+		if(file)
+			fclose(file);
+	}
+};
+
+struct BatchProgress
+{
+	atomic<int> videosDone;
+	atomic<int> videosFailed;
+	atomic<long long> framesDone;
+	atomic<int> decodersOpened;
+	atomic<int> decodersReused;
+	atomic<int> fastOpens;
+	atomic<long long> bytesRead;
+	atomic<long long> ioMicroseconds;
+	atomic<long long> readStallMicroseconds;
+
+	BatchProgress() : videosDone(0), videosFailed(0), framesDone(0), decodersOpened(0), decodersReused(0), fastOpens(0),
+		bytesRead(0), ioMicroseconds(0), readStallMicroseconds(0) {}
+};
+
+// The flattened path keeps outputs recognizable, the hash of the full path keeps them apart when flattening makes two paths
+// alike (a/b_c and a_b/c) or when the name has to be cut to fit
+string OutputPathFor(string outputDir, string videoPath)
+{
+	const size_t maxNameLength = 200;
+	string name = videoPath.size() > maxNameLength ? videoPath.substr(videoPath.size() - maxNameLength) : videoPath;
+	replace(name.begin(), name.end(), '/', '_');
+
+	uint64_t hash = 14695981039346656037ULL; // FNV-1a
+	for(size_t i = 0; i < videoPath.size(); i++)
+		hash = (hash ^ (unsigned char)videoPath[i]) * 1099511628211ULL;
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "-%016llx.desc", (unsigned long long)hash);
+	return outputDir + "/" + name + suffix;
+}
+
+bool WriteAtomically(string path, const vector<unsigned char>& data)
+{
+	string tmpPath = path + ".tmp";
+	FILE* out = fopen(tmpPath.c_str(), "wb");
+	if(!out)
+		return false;
+
+	bool ok = data.empty() || fwrite(&data[0], 1, data.size(), out) == data.size();
+	ok = fflush(out) == 0 && ok;
+	ok = fsync(fileno(out)) == 0 && ok;
+	ok = fclose(out) == 0 && ok;
+	if(!ok || rename(tmpPath.c_str(), path.c_str()) != 0)
+	{
+		remove(tmpPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+// Extraction settings shared by every job of a run
+struct JobOptions
+{
+	OutputMode Output;
+	bool RootNormalize;
+	shared_ptr<DescriptorProjection> Projection;
+	int IoBufferSize;
+	int ReadAhead;
+};
+
+void RunJob(Job& job, JobOptions& jobOptions, Manifest& manifest, BatchProgress& progress, ExtractionSession& session)
+{
+	char line[4096];
+	try
+	{
+		Options opts(job.VideoPath);
+		opts.Output = jobOptions.Output;
+		opts.RootNormalize = jobOptions.RootNormalize;
+		opts.Projection = jobOptions.Projection;
+		opts.IoBufferSize = jobOptions.IoBufferSize;
+		opts.ReadAhead = jobOptions.ReadAhead;
+
+		QuantizedDescriptorSink sink(opts.Output, opts.RootNormalize, ExtractionLayout::ChannelDims(opts));
+		ExtractionStats stats;
+		ExtractDescriptors(opts, 0, numeric_limits<double>::max(), sink, stats, NULL, &session);
+
+		if(!WriteAtomically(job.OutputPath, sink.data))
+			throw runtime_error("Can't write " + job.OutputPath);
+
+		snprintf(line, sizeof(line), "done\t%s\t%s\t%d\t%d\t%d", job.VideoPath.c_str(), job.OutputPath.c_str(), stats.EmittedPatches, stats.DescriptorDim, stats.ProcessedFrames());
+		manifest.Record(line);
+		progress.framesDone += stats.ProcessedFrames();
+		progress.bytesRead += stats.BytesRead;
+		progress.ioMicroseconds += (long long)(stats.IoMs * 1000);
+		progress.readStallMicroseconds += (long long)(stats.ReadStallMs * 1000);
+		progress.videosDone++;
+	}
+	catch(exception& e)
+	{
+		snprintf(line, sizeof(line), "failed\t%s\t%s", job.VideoPath.c_str(), e.what());
+		manifest.Record(line);
+		progress.videosFailed++;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	if(argc < 3)
+	{
+		fprintf(stderr, "Usage: %s <file_list> <output_dir> [--threads N] [--manifest path] [--output float32|float16|uint8] [--root-normalize] [--projection path] [--io-buffer-kb N] [--read-ahead packets] [--report-every seconds]\n", argv[0]);
+		return 1;
+	}
+
+	string fileList = argv[1];
+	string outputDir = argv[2];
+	string manifestPath = outputDir + "/manifest.tsv";
+	int numWorkers = max(1u, thread::hardware_concurrency());
+	JobOptions jobOptions;
+	jobOptions.Output = OutputFloat32;
+	jobOptions.RootNormalize = false;
+	jobOptions.IoBufferSize = FrameReader::defaultIoBufferSize;
+	jobOptions.ReadAhead = 0;
+	double reportEvery = 10;
+	for(int i = 3; i < argc; i++)
+	{
+		string arg = argv[i];
+		if(arg == "--threads" && i + 1 < argc)
+			numWorkers = max(1, atoi(argv[++i]));
+		else if(arg == "--manifest" && i + 1 < argc)
+			manifestPath = argv[++i];
+		else if(arg == "--output" && i + 1 < argc)
+			jobOptions.Output = Options::ParseOutputMode(argv[++i]);
+		else if(arg == "--root-normalize")
+			jobOptions.RootNormalize = true;
+		else if(arg == "--projection" && i + 1 < argc)
+			jobOptions.Projection = make_shared<DescriptorProjection>(DescriptorProjection::Load(argv[++i]));
+		else if(arg == "--io-buffer-kb" && i + 1 < argc)
+			jobOptions.IoBufferSize = max(0, atoi(argv[++i])) * 1024;
+		else if(arg == "--read-ahead" && i + 1 < argc)
+			jobOptions.ReadAhead = max(0, atoi(argv[++i]));
+		else if(arg == "--report-every" && i + 1 < argc)
+			reportEvery = atof(argv[++i]);
+		else
+		{
+			fprintf(stderr, "Unknown option: %s\n", arg.c_str());
+			return 1;
+		}
+	}
+
+	if(jobOptions.Projection && (jobOptions.Output != OutputFloat32 || jobOptions.RootNormalize))
+	{
+		fprintf(stderr, "--projection only supports float32 output without --root-normalize\n");
+		return 1;
+	}
+
+	set<string> completed = Manifest::ReadCompleted(manifestPath);
+	Manifest manifest;
+	if(!manifest.Open(manifestPath))
+	{
+		fprintf(stderr, "Could not open manifest %s\n", manifestPath.c_str());
+		return 1;
+	}
+
+	vector<Job> jobs;
+	ifstream in(fileList.c_str());
+	string videoPath;
+	int skipped = 0;
+	while(getline(in, videoPath))
+	{
+		if(videoPath.empty())
+			continue;
+		if(completed.count(videoPath))
+		{
+			skipped++;
+			continue;
+		}
+		Job job;
+		job.VideoPath = videoPath;
+		job.OutputPath = OutputPathFor(outputDir, videoPath);
+		job.FrameCount = 0;
+		job.Probed = false;
+		jobs.push_back(job);
+	}
+	log("Skipping %d videos completed by a previous run, %d left, using %s kernels", skipped, int(jobs.size()), ActiveKernels()->Name);
+
+	// probing only reads container headers, but over millions of files it still pays to spread it over the workers
+	atomic<int> nextProbe(0);
+	vector<thread> workers;
+	for(int w = 0; w < numWorkers; w++)
+	{
+		workers.push_back(thread([&]()
+		{
+			for(int i = nextProbe++; i < jobs.size(); i = nextProbe++)
+				jobs[i].Probed = probe_frame_count(jobs[i].VideoPath.c_str(), jobs[i].FrameCount);
+		}));
+	}
+	for(int w = 0; w < numWorkers; w++)
+		workers[w].join();
+	workers.clear();
+
+	vector<int> order;
+	for(int i = 0; i < jobs.size(); i++)
+	{
+		if(jobs[i].Probed)
+			order.push_back(i);
+		else
+			manifest.Record("failed\t" + jobs[i].VideoPath + "\tcould not be probed");
+	}
+	sort(order.begin(), order.end(), [&](int a, int b) { return jobs[a].FrameCount > jobs[b].FrameCount; });
+
+	WorkStealingScheduler scheduler(jobs, order, numWorkers);
+	BatchProgress progress;
+	progress.videosFailed += int(jobs.size() - order.size());
+	atomic<int> running(numWorkers);
+	for(int w = 0; w < numWorkers; w++)
+	{
+		workers.push_back(thread([&, w]()
+		{
+			// every worker keeps its decoders and buffers across its clips
+			ExtractionSession session;
+			int job;
+			while(scheduler.Next(w, job))
+				RunJob(jobs[job], jobOptions, manifest, progress, session);
+			progress.decodersOpened += session.Decoders.Opened;
+			progress.decodersReused += session.Decoders.Reused;
+			progress.fastOpens += session.FastOpens;
+			running--;
+		}));
+	}
+
+	chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+	chrono::steady_clock::time_point lastReport = begin;
+	while(running > 0)
+	{
+		this_thread::sleep_for(chrono::milliseconds(100));
+		chrono::steady_clock::time_point now = chrono::steady_clock::now();
+		if(chrono::duration<double>(now - lastReport).count() >= reportEvery)
+		{
+			double elapsed = chrono::duration<double>(now - begin).count();
+			log("Done %d/%d videos (%d failed), %.2f videos/s, %.1f frames/s, %d workers busy",
+				int(progress.videosDone), int(jobs.size()), int(progress.videosFailed),
+				progress.videosDone / elapsed, progress.framesDone / elapsed, int(running));
+			lastReport = now;
+		}
+	}
+	for(int w = 0; w < numWorkers; w++)
+		workers[w].join();
+
+	double elapsed = max(1e-3, chrono::duration<double>(chrono::steady_clock::now() - begin).count());
+	log("Finished %d videos (%d failed) in %.1f s, %.2f videos/s, %.1f frames/s",
+		int(progress.videosDone), int(progress.videosFailed), elapsed,
+		progress.videosDone / elapsed, progress.framesDone / elapsed);
+	log("Opened %d decoders and reused them %d times, skipped stream probing on %d videos",
+		int(progress.decodersOpened), int(progress.decodersReused), int(progress.fastOpens));
+	// summed over workers: stall and I/O times are worker-seconds, not wall time
+	log("Read %.1f MiB, %.1f s in storage I/O, decoding stalled %.1f s waiting for packets",
+		progress.bytesRead / 1048576.0, progress.ioMicroseconds / 1e6, progress.readStallMicroseconds / 1e6);
+	return progress.videosFailed > 0 ? 2 : 0;
+}
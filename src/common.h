@@ -1,4 +1,5 @@
 #include <cstdio>
+#include <vector>
 #include <opencv/cv.h>
 
 using namespace cv;
@@ -24,15 +25,19 @@ struct Frame
 	int64_t PTS;
 	bool NoMotionVectors;
 	char PictType;
+	int FrameSpan; // number of source frames this frame stands for, more than one when the reader skipped frames before it
+	int64_t ArrivalTime; // monotonic microseconds at which the packet completing this frame was read
+	float Lag; // live: seconds the reader was behind the stream clock when it returned this frame
+	int MotionCells; // cells that got a non-zero motion vector, 0 for an all-zero field (-1 if unknown)
 	float width;
 	float height;
 
 	Frame(int frameIndex, Mat dx, Mat dy, Mat missing)
-		: FrameIndex(frameIndex), Dx(dx), Dy(dy), Missing(missing), NoMotionVectors(false), PTS(-1), PictType('?')
+		: FrameIndex(frameIndex), Dx(dx), Dy(dy), Missing(missing), NoMotionVectors(false), PTS(-1), PictType('?'), FrameSpan(1), ArrivalTime(0), Lag(0), MotionCells(-1)
 	{
 	}
 
-	Frame(int frameIndex = -1) : FrameIndex(frameIndex), NoMotionVectors(true), PTS(-1), PictType('?')
+	Frame(int frameIndex = -1) : FrameIndex(frameIndex), NoMotionVectors(true), PTS(-1), PictType('?'), FrameSpan(1), ArrivalTime(0), Lag(0), MotionCells(-1)
 	{
 	}
 
@@ -51,9 +56,19 @@ struct Frame
 
 		if(RawImage.data)
 		{
-			Mat rawImageResized;
-			resize(RawImage, rawImageResized, afterInterpolation);
-			cvtColor(rawImageResized, RawImage, CV_BGR2GRAY);
+			// FrameReader already delivers grayscale at grid resolution, so this is a no-op without interpolation
+			if(RawImage.size() != afterInterpolation)
+			{
+				Mat rawImageResized;
+				resize(RawImage, rawImageResized, afterInterpolation);
+				RawImage = rawImageResized;
+			}
+			if(RawImage.channels() == 3)
+			{
+				Mat gray;
+				cvtColor(RawImage, gray, CV_BGR2GRAY);
+				RawImage = gray;
+			}
 		}
 	}
 };
@@ -87,6 +102,63 @@ void PrintDoubleArray(Mat& m)
 	}
 }
 
+// Receives the descriptor of every emitted patch, so the extraction loop doesn't depend on where descriptors end up
+struct DescriptorSink
+{
+	virtual ~DescriptorSink() {}
+	virtual void Append(const float* descriptor, int dim) = 0;
+	// called before the descriptors of each window with its time
+	virtual void BeginWindow(float time) {}
+	// called before the descriptors of each temporal scale when several are extracted in one pass
+	virtual void SelectScale(int scale) {}
+	// called once a window is complete, sinks that batch descriptors pass them on
+	virtual void Flush() {}
+};
+
+// Routes each temporal scale to its own sink
+struct MultiScaleSink : DescriptorSink
+{
+	std::vector<DescriptorSink*> sinks;
+	int current;
+
+	MultiScaleSink(std::vector<DescriptorSink*> sinks) : sinks(sinks), current(0)
+	{
+	}
+
+	void Append(const float* descriptor, int dim)
+	{
+		sinks[current]->Append(descriptor, dim);
+	}
+
+	void BeginWindow(float time)
+	{
+		for(int i = 0; i < sinks.size(); i++)
+			sinks[i]->BeginWindow(time);
+	}
+
+	void SelectScale(int scale)
+	{
+		current = scale;
+	}
+
+	void Flush()
+	{
+		for(int i = 0; i < sinks.size(); i++)
+			sinks[i]->Flush();
+	}
+};
+
+// Windows of ntCells temporal cells of cellLength source frames each, starting every windowStride source frames
+struct TemporalScale
+{
+	int cellLength;
+	int windowStride;
+
+	TemporalScale(int cellLength, int windowStride) : cellLength(cellLength), windowStride(windowStride)
+	{
+	}
+};
+
 struct DescInfo
 {
     int nBins; // number of bins for vector quantization
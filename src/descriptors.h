@@ -1,9 +1,16 @@
+#include <cmath>
+#include <cstring>
 #include <vector>
+#include <string>
+#include <stdexcept>
 #include <utility>
+#include <algorithm>
+#include <functional>
 
 #include <opencv/cv.h>
 
 #include "common.h"
+#include "kernel_registry.h"
 #include <boost/python.hpp>
 #include <Python.h>
 using namespace cv;
@@ -27,81 +34,349 @@ float FastSquareRootFloat(float number) {
     return number * y;
 }
 
-Mat BuildOrientationIntegralTransform(DescInfo descInfo, Mat_<float> dx, Mat_<float> dy)
+OrientationBinningParams BinningParamsFor(DescInfo descInfo)
+{
+	int angleBins = descInfo.applyThresholding ? descInfo.nBins - 1 : descInfo.nBins;
+	double fullAngle = descInfo.signedGradient ? 360 : 180;
+
+	OrientationBinningParams params;
+	params.nBins = descInfo.nBins;
+	params.angleBins = angleBins;
+	params.applyThresholding = descInfo.applyThresholding;
+	params.threshold = descInfo.threshold;
+	params.fullAngle = fullAngle;
+	params.invAngleBase = 1 / (fullAngle/double(angleBins));
+	return params;
+}
+
+// Orientation bins of every (dx, dy) on a grid of 1/scale steps divided by divisor, computed once with the exact kernel.
+// Motion vectors are whole pixels times fscale = 1/8 and MBH takes differences of those, so most moving cells land on the grid;
+// MBH-X divides the flow by the frame aspect first, which its table's divisor follows. Differences of two divided values don't
+// always round to the divided difference, so off-grid values do come up there: they go through the exact kernel, and both
+// give bitwise the same bins and weights. HOG bins intensity gradients, which rarely fall on the grid, so it never uses a table.
+struct OrientationTable
+{
+	static const int scale = 8;
+	static const int range = 64; // grid steps each way, so |dx|, |dy| <= 8
+	static const int side = 2*range + 1;
+
+	struct Entry
+	{
+		int bin0, bin1;
+		float w0, w1;
+	};
+
+	vector<Entry> entries;
+	vector<float> grid; // the table inputs along either axis
+	const KernelTable* kernels; // the kernels the entries were computed with
+	float divisor;
+	OrientationBinningParams params;
+	vector<int> misses, missBin0, missBin1;
+	vector<float> missDx, missDy, missW0, missW1;
+
+	OrientationTable() : kernels(NULL), divisor(1) {}
+
+	void Build(DescInfo descInfo, const KernelTable* kernels, float divisor = 1)
+	{
+		this->kernels = kernels;
+		this->divisor = divisor;
+		params = BinningParamsFor(descInfo);
+
+		// the same division as DivideByAspect, so inputs match it bit for bit
+		grid.resize(side);
+		for(int j = 0; j < side; j++)
+			grid[j] = float(j - range) / scale / divisor;
+
+		int n = side*side;
+		vector<float> dx(n), dy(n), w0(n), w1(n);
+		vector<int> bin0(n), bin1(n);
+		for(int i = 0; i < side; i++)
+		{
+			for(int j = 0; j < side; j++)
+			{
+				dx[i*side + j] = grid[j];
+				dy[i*side + j] = grid[i];
+			}
+		}
+		kernels->BinOrientations(&dx[0], &dy[0], n, params, &bin0[0], &bin1[0], &w0[0], &w1[0]);
+
+		entries.resize(n);
+		for(int k = 0; k < n; k++)
+		{
+			entries[k].bin0 = bin0[k];
+			entries[k].bin1 = bin1[k];
+			entries[k].w0 = w0[k];
+			entries[k].w1 = w1[k];
+		}
+	}
+
+	// Same contract as KernelTable::BinOrientations
+	void Bin(const float* dx, const float* dy, int n, int* bin0, int* bin1, float* w0, float* w1)
+	{
+		if(misses.size() < n)
+		{
+			misses.resize(n);
+			missBin0.resize(n);
+			missBin1.resize(n);
+			missDx.resize(n);
+			missDy.resize(n);
+			missW0.resize(n);
+			missW1.resize(n);
+		}
+
+		int missCount = 0;
+		const float toGrid = divisor * scale;
+		for(int j = 0; j < n; j++)
+		{
+			// the nearest grid step is only a candidate, a hit needs the value to be exactly that table input
+			float x = dx[j] * toGrid, y = dy[j] * toGrid;
+			if(fabsf(x) < range + 0.5f && fabsf(y) < range + 0.5f)
+			{
+				int ix = int(x + (x < 0 ? -0.5f : 0.5f)), iy = int(y + (y < 0 ? -0.5f : 0.5f));
+				if(grid[ix + range] == dx[j] && grid[iy + range] == dy[j])
+				{
+					const Entry& e = entries[(iy + range)*side + ix + range];
+					bin0[j] = e.bin0;
+					bin1[j] = e.bin1;
+					w0[j] = e.w0;
+					w1[j] = e.w1;
+					continue;
+				}
+			}
+			misses[missCount] = j;
+			missDx[missCount] = dx[j];
+			missDy[missCount] = dy[j];
+			missCount++;
+		}
+
+		if(missCount == 0)
+			return;
+		kernels->BinOrientations(&missDx[0], &missDy[0], missCount, params, &missBin0[0], &missBin1[0], &missW0[0], &missW1[0]);
+		for(int k = 0; k < missCount; k++)
+		{
+			int j = misses[k];
+			bin0[j] = missBin0[k];
+			bin1[j] = missBin1[k];
+			w0[j] = missW0[k];
+			w1[j] = missW1[k];
+		}
+	}
+};
+
+// The table beats the scalar atan2 of the generic kernels, but not the vectorized ones, so by default it's only used at the generic level
+enum OrientationTableMode
+{
+	OrientationTableAuto,
+	OrientationTableOn,
+	OrientationTableOff
+};
+
+OrientationTableMode orientationTableMode = OrientationTableAuto;
+
+void SetOrientationTableMode(string name)
+{
+	if(name == "auto")
+		orientationTableMode = OrientationTableAuto;
+	else if(name == "on")
+		orientationTableMode = OrientationTableOn;
+	else if(name == "off")
+		orientationTableMode = OrientationTableOff;
+	else
+		throw runtime_error("Unknown orientation table mode: " + name);
+}
+
+bool IsOrientationTableUsed()
+{
+	return orientationTableMode == OrientationTableOn || (orientationTableMode == OrientationTableAuto && ActiveKernels() == &GenericKernels);
+}
+
+// table is NULL to bin every cell with the exact kernel
+Mat BuildOrientationIntegralTransform(DescInfo descInfo, Mat_<float> dx, Mat_<float> dy, OrientationTable* table = NULL)
 {
 	Size sz = dx.size();
 	Mat dst(sz.height, sz.width*descInfo.nBins, CV_32F);
 	float* ptr_desc = dst.ptr<float>();
 	int angleBins = descInfo.applyThresholding ? descInfo.nBins - 1 : descInfo.nBins;
-
-	double fullAngle = descInfo.signedGradient ? 360 : 180;
-	float inv_angleBase = 1 / (fullAngle/double(angleBins));
+	OrientationBinningParams params = BinningParamsFor(descInfo);
 	
 	float* ptr_dx = dx.ptr<float>();
 	float* ptr_dy = dy.ptr<float>();
 	
-	vector<float> sum(descInfo.nBins);
+	vector<int> bin0(sz.width), bin1(sz.width);
+	vector<float> m0(sz.width), m1(sz.width);
+	vector<int> cols(sz.width);
+	vector<float> movingDx(sz.width), movingDy(sz.width);
+	const KernelTable* kernels = ActiveKernels();
+
+	// a zero (dx, dy) always lands in the no-motion bin with weight 1 when thresholding, and adds nothing otherwise
+	int stillBin = descInfo.applyThresholding ? angleBins : 0;
+	float stillWeight = descInfo.applyThresholding ? 1 : 0;
 	
-	for(int i = 0, index = 0; i < sz.height; i++)
+	for(int i = 0; i < sz.height; i++)
 	{
-		sum.assign(sum.size(), 0);
+		int index = i*sz.width;
+		const float* prevRow = i == 0 ? NULL : ptr_desc + (index - sz.width)*descInfo.nBins;
+		float* row = ptr_desc + index*descInfo.nBins;
 
-		for(int j = 0; j < sz.width; j++, index++)
+		int count = 0;
+		for(int j = 0; j < sz.width; j++)
 		{
-			float shiftX = ptr_dx[index];
-			float shiftY = ptr_dy[index];
-			
-			float m0 = sqrt(shiftX*shiftX+shiftY*shiftY);//FastSquareRootFloat(shiftX*shiftX + shiftY*shiftY);
-			float m1 = m0;
-
-			int bin0, bin1;
-			if(descInfo.applyThresholding && m0 <= descInfo.threshold)
+			if(ptr_dx[index + j] != 0 || ptr_dy[index + j] != 0)
 			{
-				bin0 = angleBins;
-				m0 = 1.0;
-				bin1 = 0;
-				m1 = 0;
+				cols[count] = j;
+				movingDx[count] = ptr_dx[index + j];
+				movingDy[count] = ptr_dy[index + j];
+				count++;
 			}
+		}
+
+		// mostly moving rows go through the dense kernels, sparse ones only bin their moving cells; both give the same sums
+		if(2*count > sz.width)
+		{
+			if(table)
+				table->Bin(ptr_dx + index, ptr_dy + index, sz.width, &bin0[0], &bin1[0], &m0[0], &m1[0]);
 			else
-			{
-				float orientation = fastAtan2(shiftY, shiftX);
-				if(orientation > fullAngle)
-					orientation -= fullAngle;
-				
-				float fbin = orientation * inv_angleBase;
-				bin0 = cvFloor(fbin);
-				bin1 = (bin0 + 1) % angleBins;
+				kernels->BinOrientations(ptr_dx + index, ptr_dy + index, sz.width, params, &bin0[0], &bin1[0], &m0[0], &m1[0]);
+			kernels->AccumulateIntegralRow(&bin0[0], &bin1[0], &m0[0], &m1[0], sz.width, descInfo.nBins, prevRow, row);
+		}
+		else
+		{
+			if(count > 0 && table)
+				table->Bin(&movingDx[0], &movingDy[0], count, &bin0[0], &bin1[0], &m0[0], &m1[0]);
+			else if(count > 0)
+				kernels->BinOrientations(&movingDx[0], &movingDy[0], count, params, &bin0[0], &bin1[0], &m0[0], &m1[0]);
+			kernels->AccumulateSparseIntegralRow(&cols[0], &bin0[0], &bin1[0], &m0[0], &m1[0], count, sz.width, descInfo.nBins,
+				stillBin, stillWeight, prevRow, row);
+		}
+	}
+	return dst;
+}
 
-				m1 = (fbin - bin0)*m0;
-				m0 -= m1;
-			}
+// Builds integral transforms through the table and through the exact kernel and compares them bit for bit: once over every grid value,
+// once over a random mix of grid, off-grid, out-of-range and zero values, once over the differences of a divided motion field like MBH-X's
+bool CheckOrientationTable(DescInfo descInfo, float divisor = 1, unsigned seed = 0x12345)
+{
+	OrientationTable table;
+	table.Build(descInfo, ActiveKernels(), divisor);
 
-			sum[bin0] += m0;
-			sum[bin1] += m1;
+	int side = OrientationTable::side;
+	Mat_<float> gridDx(side, side), gridDy(side, side);
+	for(int i = 0; i < side; i++)
+	{
+		for(int j = 0; j < side; j++)
+		{
+			gridDx(i, j) = table.grid[j];
+			gridDy(i, j) = table.grid[i];
+		}
+	}
 
-			int temp0 = index*descInfo.nBins;
-			if(i == 0)
-			{
-				for(int m = 0; m < descInfo.nBins; m++)
-					ptr_desc[temp0++] = sum[m];
-			}
-			else
+	RNG rng(seed);
+	Mat_<float> mixedDx(64, 64), mixedDy(64, 64);
+	for(int i = 0; i < mixedDx.rows; i++)
+	{
+		for(int j = 0; j < mixedDx.cols; j++)
+		{
+			float* v[] = { &mixedDx(i, j), &mixedDy(i, j) };
+			for(int k = 0; k < 2; k++)
 			{
-				int temp1 = (index - sz.width)*descInfo.nBins;
-				for(int m = 0; m < descInfo.nBins; m++)
+				switch(rng.uniform(0, 4))
 				{
-					ptr_desc[temp0++] = ptr_desc[temp1++]+sum[m];
+					case 0: *v[k] = 0; break;
+					case 1: *v[k] = table.grid[rng.uniform(0, side)]; break;
+					case 2: *v[k] = float(rng.uniform(-2048, 2049)) / OrientationTable::scale; break;
+					default: *v[k] = rng.uniform(-20.f, 20.f); break;
 				}
 			}
 		}
 	}
+
+	Mat_<float> flow(64, 64), dividedDx(64, 64), dividedDy(64, 64);
+	for(int i = 0; i < flow.rows; i++)
+		for(int j = 0; j < flow.cols; j++)
+			flow(i, j) = rng.uniform(0, 3) == 0 ? 0 : float(rng.uniform(-32, 33)) / OrientationTable::scale / divisor;
+	ActiveKernels()->CentralDifferences(flow.ptr<float>(), flow.rows, flow.cols, dividedDx.ptr<float>(), dividedDy.ptr<float>());
+
+	Mat_<float>* fields[][2] = { { &gridDx, &gridDy }, { &mixedDx, &mixedDy }, { &dividedDx, &dividedDy } };
+	for(int f = 0; f < 3; f++)
+	{
+		Mat exact = BuildOrientationIntegralTransform(descInfo, *fields[f][0], *fields[f][1]);
+		Mat looked = BuildOrientationIntegralTransform(descInfo, *fields[f][0], *fields[f][1], &table);
+		if(memcmp(exact.ptr<float>(), looked.ptr<float>(), exact.total() * sizeof(float)) != 0)
+			return false;
+	}
+	return true;
+}
+
+// The horizontal flow divided by the frame aspect (height/width), as MBH-X sees it; element by element so orientation tables can
+// reproduce the values exactly
+Mat_<float> DivideByAspect(Mat_<float> dx, float aspect)
+{
+	Mat_<float> dst(dx.size());
+	for(int i = 0; i < dx.rows; i++)
+	{
+		const float* src = dx.ptr<float>(i);
+		float* out = dst.ptr<float>(i);
+		for(int j = 0; j < dx.cols; j++)
+			out[j] = src[j] / aspect;
+	}
+	return dst;
+}
+
+// 1-tap Sobel of a continuous float matrix in both directions at once
+void ComputeGradients(Mat src, Mat& dX, Mat& dY)
+{
+	Mat_<float> src32 = src;
+	dX.create(src.size(), CV_32F);
+	dY.create(src.size(), CV_32F);
+	ActiveKernels()->CentralDifferences(src32.ptr<float>(), src.rows, src.cols, dX.ptr<float>(), dY.ptr<float>());
+}
+
+// Orientation integral transform of an all-zero field: only the no-motion bin fills up, one per cell, when thresholding
+Mat BuildStillIntegralTransform(DescInfo descInfo, Size sz)
+{
+	Mat dst = Mat::zeros(sz.height, sz.width*descInfo.nBins, CV_32F);
+	if(descInfo.applyThresholding)
+	{
+		for(int i = 0; i < sz.height; i++)
+		{
+			float* row = dst.ptr<float>(i);
+			for(int j = 0; j < sz.width; j++)
+				row[j*descInfo.nBins + descInfo.nBins - 1] = float((i + 1)*(j + 1));
+		}
+	}
 	return dst;
 }
 
+Mat BuildMotionEnergyIntegralTransform(Mat_<float> dx, Mat_<float> dy)
+{
+	Size sz = dx.size();
+	Mat dst(sz.height, sz.width, CV_32F);
+	float* ptr_energy = dst.ptr<float>();
+
+	float* ptr_dx = dx.ptr<float>();
+	float* ptr_dy = dy.ptr<float>();
+
+	for(int i = 0, index = 0; i < sz.height; i++)
+	{
+		float sum = 0;
+		for(int j = 0; j < sz.width; j++, index++)
+		{
+			float shiftX = ptr_dx[index];
+			float shiftY = ptr_dy[index];
+			sum += sqrt(shiftX*shiftX+shiftY*shiftY);
+
+			ptr_energy[index] = i == 0 ? sum : ptr_energy[index - sz.width] + sum;
+		}
+	}
+	return dst;
+}
+
+const float descriptorEpsilon = 0.05;
+
 void ComputeDescriptor(Mat& integralTransform, Rect rect, DescInfo descInfo, float* desc)
 {
 
-	const float epsilon = 0.05;
+	const float epsilon = descriptorEpsilon;
 
 	int height = integralTransform.rows;
 	int width = integralTransform.cols / descInfo.nBins;
@@ -149,38 +424,177 @@ void ComputeDescriptor(Mat& integralTransform, Rect rect, DescInfo descInfo, flo
 	}
 
 	//normalize(vec, vec, 1, 0, descInfo.norm);
-	vec /= norm(vec, descInfo.norm);
+	if(descInfo.norm == NORM_L2)
+		ActiveKernels()->NormalizeL2(desc, descInfo.dim);
+	else
+		vec /= norm(vec, descInfo.norm);
 }
 
 
+// Same as ComputeDescriptor, but each cell is the difference of two spatio-temporal integral volumes (eight corners per bin) times scale;
+// a NULL begin stands for the all-zero volume before the first frame
+void ComputeVolumeDescriptor(const Mat& end, const Mat* begin, double scale, Rect rect, DescInfo descInfo, float* desc)
+{
+	const float epsilon = descriptorEpsilon;
+
+	int height = end.rows;
+	int width = end.cols / descInfo.nBins;
+
+	const double* ptr_end = end.ptr<double>();
+	const double* ptr_begin = begin ? begin->ptr<double>() : NULL;
+
+	Mat_<float> vec(1, descInfo.dim, desc, Mat::AUTO_STEP);
+	float* ptr_vec = desc;
+	int xStride = rect.width/descInfo.nxCells;
+	int yStride = rect.height/descInfo.nyCells;
+
+	for (int iX = 0, iDesc = 0; iX < descInfo.nxCells; ++iX)
+	for (int iY = 0; iY < descInfo.nyCells; ++iY)
+	{
+		int left = rect.x + iX*xStride - 1;
+		int right = std::min<int>(left + xStride + 1, width-1);
+		int top = rect.y + iY*yStride - 1;
+		int bottom = std::min<int>(top + yStride + 1, height-1);
+
+		int TopLeft = (top*width+left)*descInfo.nBins;
+		int TopRight = (top*width+right)*descInfo.nBins;
+		int BottomLeft = (bottom*width+left)*descInfo.nBins;
+		int BottomRight = (bottom*width+right)*descInfo.nBins;
+
+		for (int i = 0; i < descInfo.nBins; ++i, ++iDesc)
+		{
+			double sum = ptr_end[BottomRight+i] - (ptr_begin ? ptr_begin[BottomRight+i] : 0);
+			if (top >= 0)
+				sum -= ptr_end[TopRight+i] - (ptr_begin ? ptr_begin[TopRight+i] : 0);
+			if (left >= 0)
+				sum -= ptr_end[BottomLeft+i] - (ptr_begin ? ptr_begin[BottomLeft+i] : 0);
+			if (top >= 0 && left >= 0)
+				sum += ptr_end[TopLeft+i] - (ptr_begin ? ptr_begin[TopLeft+i] : 0);
+
+			ptr_vec[iDesc] = epsilon + float(sum * scale);
+		}
+	}
+
+	if(descInfo.norm == NORM_L2)
+		ActiveKernels()->NormalizeL2(desc, descInfo.dim);
+	else
+		vec /= norm(vec, descInfo.norm);
+}
+
+// Rolling spatio-temporal integral volume: slot t % capacity holds the sum of the integral transforms of frames 0..t, i.e. an integral
+// over x, y and t per bin, so any run of frames [a, b) still in the ring is summed with eight corner lookups. Sums are kept in doubles
+// because they grow over the whole video.
+struct IntegralVolume
+{
+	vector<Mat> ring;
+	int capacity;
+	long long frames;
+
+	IntegralVolume() : capacity(0), frames(0)
+	{
+	}
+
+	// capacity is the longest run of frames to be queried plus one, for the volume just before it; slots allocated earlier are reused
+	void Reset(int capacity)
+	{
+		this->capacity = std::max(2, capacity);
+		if(ring.size() < this->capacity)
+			ring.resize(this->capacity);
+		frames = 0;
+	}
+
+	void Disable()
+	{
+		capacity = 0;
+		frames = 0;
+	}
+
+	// A frame standing for frameSpan source frames takes that many slots. Frames that fall out of the ring are never queried, so a span
+	// longer than the ring only fills the ring and restarts the sums, the offset that leaves cancels out in every query.
+	void Push(const Mat& integralTransform, int frameSpan = 1)
+	{
+		long long skipped = std::max(0, frameSpan - capacity);
+		frames += skipped;
+		Mat frame;
+		integralTransform.convertTo(frame, CV_64F);
+		for(int i = 0; i < frameSpan - skipped; i++)
+		{
+			Mat& slot = ring[frames % capacity];
+			frame.copyTo(slot);
+			if(frames > 0 && (i > 0 || skipped == 0))
+				slot += ring[(frames - 1) % capacity];
+			frames++;
+		}
+	}
+
+	// Descriptor of ntCells consecutive cells of cellLength frames starting at frame windowBegin
+	void QueryPatchDescriptor(Rect rect, long long windowBegin, int cellLength, DescInfo& descInfo, float* res)
+	{
+		if(windowBegin < frames - capacity + 1 || windowBegin + descInfo.ntCells*cellLength > frames)
+			throw runtime_error("Temporal window is out of the integral volume ring");
+
+		descInfo.ResetPatchDescriptorBuffer(res);
+		for(int iT = 0; iT < descInfo.ntCells; iT++)
+		{
+			long long begin = windowBegin + iT*cellLength;
+			long long end = begin + cellLength;
+			ComputeVolumeDescriptor(ring[(end - 1) % capacity], begin > 0 ? &ring[(begin - 1) % capacity] : NULL, 1.0 / cellLength, rect, descInfo, res + iT*descInfo.dim);
+		}
+	}
+};
+
 struct HistogramBuffer
 {
-	vector<pair<Mat, Mat > > currentStack;
+	vector<pair<Mat, Mat > > currentStack; // still frames are kept as a pair of empty matrices
 	vector<Mat> gluedIntegralTransforms;
+	IntegralVolume volume;
+	Mat stillIntegralTransform;
+	OrientationTable orientationTable;
+	float gridDivisor; // the inputs are divided by this before binning, the frame aspect for MBH-X
+	bool onMotionGrid; // HOF and MBH bin motion vectors and their differences; HOG's intensity gradients miss the table's grid
 	DescInfo descInfo;
 	int tStride;
 
-	HistogramBuffer(DescInfo descInfo, int tStride) : 
+	HistogramBuffer(DescInfo descInfo, int tStride, bool onMotionGrid = true) : 
 		descInfo(descInfo),
+		gridDivisor(1),
+		onMotionGrid(onMotionGrid),
 		tStride(tStride)
 	{
 		gluedIntegralTransforms.resize(descInfo.ntCells);
 	}
 
-	void AddUpCurrentStack()
+	// NULL when the exact kernels should bin; rebuilt whenever the active kernels or the divisor change under it
+	OrientationTable* Table()
+	{
+		if(!onMotionGrid || !IsOrientationTableUsed())
+			return NULL;
+		if(orientationTable.kernels != ActiveKernels() || orientationTable.divisor != gridDivisor)
+			orientationTable.Build(descInfo, ActiveKernels(), gridDivisor);
+		return &orientationTable;
+	}
+
+	// Closes the next cells temporal cells with the current stack, repeating it when one stack spans several cells
+	void AddUpCurrentStack(int cells = 1)
 	{
 		Mat cumulativeIntegralTransform;
 		for(int i = 0; i < currentStack.size(); i++)
 		{
-			Mat integralTransform = BuildOrientationIntegralTransform(descInfo, currentStack[i].first, currentStack[i].second);
+			Mat integralTransform = currentStack[i].first.empty()
+				? stillIntegralTransform
+				: BuildOrientationIntegralTransform(descInfo, currentStack[i].first, currentStack[i].second, Table());
 			if(i == 0)
-				cumulativeIntegralTransform = integralTransform;
+				cumulativeIntegralTransform = currentStack[i].first.empty() ? integralTransform.clone() : integralTransform;
 			else
 				cumulativeIntegralTransform += integralTransform;
 		}
 
-		rotate(gluedIntegralTransforms.begin(), ++gluedIntegralTransforms.begin(), gluedIntegralTransforms.end());
-		gluedIntegralTransforms.back() = cumulativeIntegralTransform / tStride;
+		Mat cell = cumulativeIntegralTransform / double(currentStack.size());
+		for(int i = 0; i < std::min<int>(cells, gluedIntegralTransforms.size()); i++)
+		{
+			rotate(gluedIntegralTransforms.begin(), ++gluedIntegralTransforms.begin(), gluedIntegralTransforms.end());
+			gluedIntegralTransforms.back() = cell;
+		}
 		currentStack.clear();
 	}
 
@@ -191,9 +605,265 @@ struct HistogramBuffer
 			ComputeDescriptor(gluedIntegralTransforms[iT], rect, descInfo, res + iT*descInfo.dim);
 	}
 
-	void Update(Mat dx, Mat dy)
+	// Cell histograms of every cell position at once, laid out like the integral transforms: entry (y, x) holds what
+	// ComputeDescriptor sums for a cell with top-left corner (y, x), epsilon included. Dense patches share these.
+	void ComputeCellHistograms(int cellWidth, int cellHeight, vector<Mat>& planes)
+	{
+		const float epsilon = descriptorEpsilon;
+		int nBins = descInfo.nBins;
+		planes.resize(gluedIntegralTransforms.size());
+		for(int iT = 0; iT < gluedIntegralTransforms.size(); iT++)
+		{
+			Mat& integralTransform = gluedIntegralTransforms[iT];
+			int height = integralTransform.rows;
+			int width = integralTransform.cols / nBins;
+			planes[iT].create(height, width*nBins, CV_32F);
+
+			for(int y = 0; y < height; y++)
+			{
+				int top = y - 1;
+				int bottom = std::min<int>(y + cellHeight, height-1);
+				const float* rowTop = top >= 0 ? integralTransform.ptr<float>(top) : NULL;
+				const float* rowBottom = integralTransform.ptr<float>(bottom);
+				float* out = planes[iT].ptr<float>(y);
+
+				for(int x = 0; x < width; x++)
+				{
+					int left = x - 1;
+					int right = std::min<int>(x + cellWidth, width-1);
+					const float* bottomRight = rowBottom + right*nBins;
+					float* cell = out + x*nBins;
+					if(top >= 0 && left >= 0)
+					{
+						const float* topLeft = rowTop + left*nBins;
+						const float* topRight = rowTop + right*nBins;
+						const float* bottomLeft = rowBottom + left*nBins;
+						for(int i = 0; i < nBins; i++)
+							cell[i] = epsilon + bottomRight[i] + topLeft[i] - bottomLeft[i] - topRight[i];
+					}
+					else if(top >= 0)
+					{
+						const float* topRight = rowTop + right*nBins;
+						for(int i = 0; i < nBins; i++)
+							cell[i] = epsilon + bottomRight[i] - topRight[i];
+					}
+					else if(left >= 0)
+					{
+						const float* bottomLeft = rowBottom + left*nBins;
+						for(int i = 0; i < nBins; i++)
+							cell[i] = epsilon + bottomRight[i] - bottomLeft[i];
+					}
+					else
+					{
+						for(int i = 0; i < nBins; i++)
+							cell[i] = epsilon + bottomRight[i];
+					}
+				}
+			}
+		}
+	}
+
+	// Descriptors of all rows x cols patch positions (stride 1) into out, each dim floats apart, starting at offset within a row
+	void QueryDensePatchDescriptors(int blockWidth, int blockHeight, int rows, int cols, int dim, int offset, float* out)
+	{
+		int cellWidth = blockWidth / descInfo.nxCells;
+		int cellHeight = blockHeight / descInfo.nyCells;
+		int nBins = descInfo.nBins;
+		vector<Mat> planes;
+		ComputeCellHistograms(cellWidth, cellHeight, planes);
+
+		for(int iT = 0; iT < descInfo.ntCells; iT++)
+		for(int y = 0; y < rows; y++)
+		for(int x = 0; x < cols; x++)
+		{
+			float* desc = out + (y*cols + x)*dim + offset + iT*descInfo.dim;
+			for(int iX = 0, iDesc = 0; iX < descInfo.nxCells; ++iX)
+			for(int iY = 0; iY < descInfo.nyCells; ++iY, iDesc += nBins)
+				memcpy(desc + iDesc, planes[iT].ptr<float>(y + iY*cellHeight) + (x + iX*cellWidth)*nBins, nBins*sizeof(float));
+
+			if(descInfo.norm == NORM_L2)
+				ActiveKernels()->NormalizeL2(desc, descInfo.dim);
+			else
+			{
+				Mat_<float> vec(1, descInfo.dim, desc, Mat::AUTO_STEP);
+				vec /= norm(vec, descInfo.norm);
+			}
+		}
+	}
+
+	void Reset()
+	{
+		currentStack.clear();
+		volume.Disable();
+	}
+
+	// Frames go into the integral volume instead of the stack from now on
+	void EnableVolume(int capacity)
+	{
+		volume.Reset(capacity);
+	}
+
+	bool IsVolumeEnabled()
+	{
+		return volume.capacity > 0;
+	}
+
+	// frameSpan is the number of source frames the frame stands for, the volume gives it that many slots
+	void Update(Mat dx, Mat dy, int frameSpan = 1)
+	{
+		if(IsVolumeEnabled())
+			volume.Push(BuildOrientationIntegralTransform(descInfo, dx, dy, Table()), frameSpan);
+		else
+			currentStack.push_back(make_pair(dx, dy));	
+	}
+
+	// A frame with an all-zero field of size sz: its integral transform is known up front and shared by all still frames
+	void UpdateStill(Size sz, int frameSpan = 1)
+	{
+		if(stillIntegralTransform.rows != sz.height || stillIntegralTransform.cols != sz.width*descInfo.nBins)
+			stillIntegralTransform = BuildStillIntegralTransform(descInfo, sz);
+
+		if(IsVolumeEnabled())
+			volume.Push(stillIntegralTransform, frameSpan);
+		else
+			currentStack.push_back(make_pair(Mat(), Mat()));
+	}
+};
+
+// Integral images of the flow magnitude, one per temporal cell, used to reject static patches before any descriptor math
+struct MotionEnergyBuffer
+{
+	vector<pair<Mat, Mat > > currentStack;
+	vector<Mat> gluedIntegralTransforms;
+	IntegralVolume volume; // with temporal scales, like the histograms
+	int tStride;
+
+	MotionEnergyBuffer(int ntCells, int tStride) :
+		tStride(tStride)
+	{
+		gluedIntegralTransforms.resize(ntCells);
+	}
+
+	// Closes the next cells temporal cells with the current stack, repeating it when one stack spans several cells
+	void AddUpCurrentStack(int cells = 1)
+	{
+		Mat cumulativeIntegralTransform;
+		for(int i = 0; i < currentStack.size(); i++)
+		{
+			Mat integralTransform = BuildMotionEnergyIntegralTransform(currentStack[i].first, currentStack[i].second);
+			if(i == 0)
+				cumulativeIntegralTransform = integralTransform;
+			else
+				cumulativeIntegralTransform += integralTransform;
+		}
+
+		Mat cell = cumulativeIntegralTransform / double(currentStack.size());
+		for(int i = 0; i < std::min<int>(cells, gluedIntegralTransforms.size()); i++)
+		{
+			rotate(gluedIntegralTransforms.begin(), ++gluedIntegralTransforms.begin(), gluedIntegralTransforms.end());
+			gluedIntegralTransforms.back() = cell;
+		}
+		currentStack.clear();
+	}
+
+	// Mean flow magnitude per pixel and temporal cell over the nxCells x nyCells cells ComputeDescriptor sums for rect. When the
+	// patch size isn't a multiple of the cell count those stop short of the right and bottom edges of rect.
+	float QueryPatchEnergy(Rect rect, int nxCells, int nyCells)
+	{
+		int left = rect.x - 1;
+		int top = rect.y - 1;
+		int right = std::min<int>(rect.x + nxCells*(rect.width/nxCells), gluedIntegralTransforms.back().cols - 1);
+		int bottom = std::min<int>(rect.y + nyCells*(rect.height/nyCells), gluedIntegralTransforms.back().rows - 1);
+
+		float energy = 0;
+		for(int iT = 0; iT < gluedIntegralTransforms.size(); iT++)
+		{
+			Mat_<float> integralTransform = gluedIntegralTransforms[iT];
+			energy += integralTransform(bottom, right);
+			if(top >= 0)
+				energy -= integralTransform(top, right);
+			if(left >= 0)
+				energy -= integralTransform(bottom, left);
+			if(top >= 0 && left >= 0)
+				energy += integralTransform(top, left);
+		}
+		return energy / ((right - left) * (bottom - top) * gluedIntegralTransforms.size());
+	}
+
+	// Same as QueryPatchEnergy, over the frames windowBegin..windowBegin+frames of the integral volume
+	float QueryWindowEnergy(Rect rect, int nxCells, int nyCells, long long windowBegin, int frames)
+	{
+		if(windowBegin < volume.frames - volume.capacity + 1 || windowBegin + frames > volume.frames)
+			throw runtime_error("Temporal window is out of the integral volume ring");
+
+		Mat_<double> end = volume.ring[(windowBegin + frames - 1) % volume.capacity];
+		Mat_<double> begin = windowBegin > 0 ? volume.ring[(windowBegin - 1) % volume.capacity] : Mat_<double>();
+		int left = rect.x - 1;
+		int top = rect.y - 1;
+		int right = std::min<int>(rect.x + nxCells*(rect.width/nxCells), end.cols - 1);
+		int bottom = std::min<int>(rect.y + nyCells*(rect.height/nyCells), end.rows - 1);
+
+		double energy = end(bottom, right) - (begin.empty() ? 0 : begin(bottom, right));
+		if(top >= 0)
+			energy -= end(top, right) - (begin.empty() ? 0 : begin(top, right));
+		if(left >= 0)
+			energy -= end(bottom, left) - (begin.empty() ? 0 : begin(bottom, left));
+		if(top >= 0 && left >= 0)
+			energy += end(top, left) - (begin.empty() ? 0 : begin(top, left));
+		return float(energy / ((right - left) * (bottom - top) * double(frames)));
+	}
+
+	void Reset()
+	{
+		currentStack.clear();
+		volume.Disable();
+	}
+
+	void EnableVolume(int capacity)
+	{
+		volume.Reset(capacity);
+	}
+
+	bool IsVolumeEnabled()
+	{
+		return volume.capacity > 0;
+	}
+
+	void Update(Mat dx, Mat dy, int frameSpan = 1)
+	{
+		if(IsVolumeEnabled())
+			volume.Push(BuildMotionEnergyIntegralTransform(dx, dy), frameSpan);
+		else
+			currentStack.push_back(make_pair(dx, dy));
+	}
+};
+
+// Dense descriptors of consecutive windows for one patch size, as a (windows, rows, cols, dim) row-major tensor
+struct DenseDescriptorTensor
+{
+	Size patchSize;
+	int windows, rows, cols, dim;
+	vector<float> data;
+
+	DenseDescriptorTensor(Size patchSize) : patchSize(patchSize), windows(0), rows(0), cols(0), dim(0)
 	{
-		currentStack.push_back(make_pair(dx, dy));	
+	}
+};
+
+struct PythonListSink : DescriptorSink
+{
+	boost::python::list& descriptors;
+
+	PythonListSink(boost::python::list& descriptors) : descriptors(descriptors)
+	{
+	}
+
+	void Append(const float* descriptor, int dim)
+	{
+		for(int i = 0; i < dim; i++)
+		{
+			descriptors.append(descriptor[i]);
+		}
 	}
 };
 
@@ -203,6 +873,9 @@ struct HofMbhBuffer
 	bool print;
 	bool AreDescriptorsReady;
 	vector<float> effectiveFrameIndices;
+	int effectiveFrameSpan; // source frames covered by effectiveFrameIndices, larger than their count when the reader skips frames
+	int stackFrameSpan;
+	int closedCells; // temporal cells closed since the window was last reset
 	int tStride;
 	int ntCells;
 	double fScale;
@@ -212,6 +885,20 @@ struct HofMbhBuffer
 	HistogramBuffer hof;
 	HistogramBuffer mbhX;
 	HistogramBuffer mbhY;
+	MotionEnergyBuffer motionEnergy;
+
+	// patches whose mean flow magnitude over the descriptor cells is below the threshold are skipped; top-K keeps only the most moving patches of a window (0 disables either)
+	float motionEnergyThreshold;
+	int motionEnergyTopK;
+	int prunedPatchCount;
+	int emittedPatchCount;
+
+	// with temporal scales the histograms come from integral volumes: ReadyScales lists the scales whose window ends at the last frame
+	vector<TemporalScale> temporalScales;
+	vector<int> ReadyScales;
+	long long volumeFrames;
+	long long windowBegin;
+	int windowCellLength;
 
 	Mat patchDescriptor;
 
@@ -272,7 +959,15 @@ struct HofMbhBuffer
 		hof(hofInfo, tStride),
 		mbhX(mbhInfo, tStride),
 		mbhY(mbhInfo, tStride),
-		hog(hogInfo, tStride),
+		hog(hogInfo, tStride, false),
+		motionEnergy(ntCells, tStride),
+		motionEnergyThreshold(0),
+		motionEnergyTopK(0),
+		prunedPatchCount(0),
+		emittedPatchCount(0),
+		volumeFrames(0),
+		windowBegin(0),
+		windowCellLength(tStride),
 
 		hog_patchDescriptor(NULL), 
 		hof_patchDescriptor(NULL),
@@ -282,63 +977,185 @@ struct HofMbhBuffer
 		hogInfo(hogInfo),
 		hofInfo(hofInfo),
 		mbhInfo(mbhInfo),
+		effectiveFrameSpan(0),
+		stackFrameSpan(0),
+		closedCells(0),
 		AreDescriptorsReady(false)
 	{
 		CreatePatchDescriptorPlaceholder(hogInfo, hofInfo, mbhInfo);
 	}
 
-	void Update(Frame& frame, float time, double hofCorrectionFactor)
+	// Starts over on a new clip but keeps the allocations; pruning and temporal scales have to be enabled again
+	void Reset(Size frameSizeAfterInterpolation, int frameCount)
 	{
-		if(hofInfo.enabled)
+		this->frameSizeAfterInterpolation = frameSizeAfterInterpolation;
+		this->frameCount = frameCount;
+		AreDescriptorsReady = false;
+		effectiveFrameIndices.clear();
+		effectiveFrameSpan = 0;
+		stackFrameSpan = 0;
+		closedCells = 0;
+		motionEnergyThreshold = 0;
+		motionEnergyTopK = 0;
+		prunedPatchCount = 0;
+		emittedPatchCount = 0;
+		temporalScales.clear();
+		ReadyScales.clear();
+		volumeFrames = 0;
+		windowBegin = 0;
+		windowCellLength = tStride;
+
+		hog.Reset();
+		hof.Reset();
+		mbhX.Reset();
+		mbhY.Reset();
+		motionEnergy.Reset();
+	}
+
+	void EnableMotionEnergyPruning(float threshold, int topK)
+	{
+		motionEnergyThreshold = threshold;
+		motionEnergyTopK = topK;
+	}
+
+	bool IsMotionEnergyPruningEnabled()
+	{
+		return motionEnergyThreshold > 0 || motionEnergyTopK > 0;
+	}
+
+	// Replaces the fixed ntCells x tStride windows by one window sequence per scale, all served from the same integral volumes.
+	// The dense engine only works with the fixed windows.
+	void EnableTemporalScales(const vector<TemporalScale>& scales)
+	{
+		int longestWindow = 0;
+		for(int s = 0; s < scales.size(); s++)
 		{
-			hof.Update(frame.Dx*hofCorrectionFactor, frame.Dy*hofCorrectionFactor);
+			if(scales[s].cellLength < 1 || scales[s].windowStride < 1)
+				throw runtime_error("Temporal cell length and window stride must be positive");
+			longestWindow = std::max(longestWindow, ntCells * scales[s].cellLength);
 		}
+		temporalScales = scales;
+		hog.EnableVolume(longestWindow + 1);
+		hof.EnableVolume(longestWindow + 1);
+		mbhX.EnableVolume(longestWindow + 1);
+		mbhY.EnableVolume(longestWindow + 1);
+		motionEnergy.EnableVolume(longestWindow + 1);
+	}
 
-		if(mbhInfo.enabled)
+	// Windows of length window every windowStride frames that have ended within the first frames frames
+	static long long WindowsEnded(long long frames, long long window, int windowStride)
+	{
+		return frames < window ? 0 : (frames - window) / windowStride + 1;
+	}
+
+	// Makes the patch queries use the window of scale s that ends at the last frame
+	void SelectScale(int s)
+	{
+		windowCellLength = temporalScales[s].cellLength;
+		windowBegin = volumeFrames - ntCells * windowCellLength;
+	}
+
+	void QueryPatchDescriptor(HistogramBuffer& buffer, Rect rect, float* res)
+	{
+		if(buffer.IsVolumeEnabled())
+			buffer.volume.QueryPatchDescriptor(rect, windowBegin, windowCellLength, buffer.descInfo, res);
+		else
+			buffer.QueryPatchDescriptor(rect, res);
+	}
+
+	void Update(Frame& frame, float time, double hofCorrectionFactor, int frameSpan = 1)
+	{
+		if(IsMotionEnergyPruningEnabled())
+		{
+			motionEnergy.Update(frame.Dx, frame.Dy, frameSpan);
+		}
+
+		// nothing moved: skip straight to the known histograms of a zero field
+		bool still = frame.MotionCells == 0;
+
+		if(hofInfo.enabled && still)
+		{
+			hof.UpdateStill(frame.Dx.size(), frameSpan);
+		}
+		else if(hofInfo.enabled)
+		{
+			hof.Update(frame.Dx*hofCorrectionFactor, frame.Dy*hofCorrectionFactor, frameSpan);
+		}
+
+		if(mbhInfo.enabled && still)
+		{
+			mbhX.UpdateStill(frame.Dx.size(), frameSpan);
+			mbhY.UpdateStill(frame.Dx.size(), frameSpan);
+		}
+		else if(mbhInfo.enabled)
 		{
 			Mat flowXdX, flowXdY, flowYdX, flowYdY;
-			Sobel(frame.Dx/(frame.height/frame.width), flowXdX, CV_32F, 1, 0, 1);
-			Sobel(frame.Dx/(frame.height/frame.width), flowXdY, CV_32F, 0, 1, 1);
-			Sobel(frame.Dy, flowYdX, CV_32F, 1, 0, 1);
-			Sobel(frame.Dy, flowYdY, CV_32F, 0, 1, 1);
+			float aspect = frame.height/frame.width;
+			mbhX.gridDivisor = aspect;
+			ComputeGradients(DivideByAspect(frame.Dx, aspect), flowXdX, flowXdY);
+			ComputeGradients(frame.Dy, flowYdX, flowYdY);
 			
 			/*Sobel(frame.Dx, flowXdX, CV_32F, 1, 0, 1);
 			Sobel(frame.Dx, flowXdY, CV_32F, 0, 1, 1);
 			Sobel(frame.Dy, flowYdX, CV_32F, 1, 0, 1);
 			Sobel(frame.Dy, flowYdY, CV_32F, 0, 1, 1);
 			*/
-			mbhX.Update(flowXdX, flowXdY);
-			mbhY.Update(flowYdX, flowYdY);
+			mbhX.Update(flowXdX, flowXdY, frameSpan);
+			mbhY.Update(flowYdX, flowYdY, frameSpan);
 		}
 
 		if(hogInfo.enabled)
 		{
 			Mat dx, dy;
-			Sobel(frame.RawImage, dx, CV_32F, 1, 0, 1);
-			Sobel(frame.RawImage, dy, CV_32F, 0, 1, 1);
-			hog.Update(dx, dy);
+			ComputeGradients(frame.RawImage, dx, dy);
+			hog.Update(dx, dy, frameSpan);
 		}
 
 		effectiveFrameIndices.push_back(time);
+		effectiveFrameSpan += frameSpan;
+		stackFrameSpan += frameSpan;
 		AreDescriptorsReady = false;
-		if(effectiveFrameIndices.size() % tStride == 0)
+		if(!temporalScales.empty())
 		{
+			// volumes count source frames like the fixed windows: a frame standing for several may step over window ends, those
+			// make one window ending at this frame
+			long long previousFrames = volumeFrames;
+			volumeFrames += frameSpan;
+			ReadyScales.clear();
+			for(int s = 0; s < temporalScales.size(); s++)
+			{
+				long long window = ntCells * temporalScales[s].cellLength;
+				if(WindowsEnded(volumeFrames, window, temporalScales[s].windowStride) > WindowsEnded(previousFrames, window, temporalScales[s].windowStride))
+					ReadyScales.push_back(s);
+			}
+			AreDescriptorsReady = !ReadyScales.empty();
+		}
+		else if(stackFrameSpan >= tStride)
+		{
+			// a frame standing for more than tStride source frames closes several cells at once
+			int cells = stackFrameSpan / tStride;
+			stackFrameSpan -= cells * tStride;
 			if(hofInfo.enabled)
 			{
-				hof.AddUpCurrentStack();
+				hof.AddUpCurrentStack(cells);
 			}
 
 			if(mbhInfo.enabled)
 			{
-				mbhX.AddUpCurrentStack();
-				mbhY.AddUpCurrentStack();
+				mbhX.AddUpCurrentStack(cells);
+				mbhY.AddUpCurrentStack(cells);
 			}
 			if(hogInfo.enabled)
 			{
-				hog.AddUpCurrentStack();
+				hog.AddUpCurrentStack(cells);
+			}
+			if(IsMotionEnergyPruningEnabled())
+			{
+				motionEnergy.AddUpCurrentStack(cells);
 			}
 
-			AreDescriptorsReady = effectiveFrameIndices.size() >= ntCells * tStride;
+			closedCells += cells;
+			AreDescriptorsReady = closedCells >= ntCells;
 		}
 	}
 
@@ -356,7 +1173,7 @@ struct HofMbhBuffer
 
 	void PrintPatchDescriptorHeader(Rect rect)
 	{
-		int firstFrame = effectiveFrameIndices[effectiveFrameIndices.size()-ntCells*tStride];
+		int firstFrame = effectiveFrameIndices.front();
 		int lastFrame = effectiveFrameIndices.back();
 		Point patchCenter(rect.x + rect.width/2, rect.y + rect.height/2);
 	/*	printf("%.2lf\t%.2lf\t%.2lf\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t", 
@@ -372,21 +1189,22 @@ struct HofMbhBuffer
 			int(rect.height / fScale));
 	*/}
 
-	void PrintPatchDescriptor(Rect rect, boost::python::list & descriptors)
+	void PrintPatchDescriptor(Rect rect, DescriptorSink& sink)
 	{
 		if(hofInfo.enabled)
 		{
-			hof.QueryPatchDescriptor(rect, hof_patchDescriptor);
+			QueryPatchDescriptor(hof, rect, hof_patchDescriptor);
 		}
 		if(mbhInfo.enabled)
 		{
-			mbhX.QueryPatchDescriptor(rect, mbhX_patchDescriptor);
-			mbhY.QueryPatchDescriptor(rect, mbhY_patchDescriptor);
+			QueryPatchDescriptor(mbhX, rect, mbhX_patchDescriptor);
+			QueryPatchDescriptor(mbhY, rect, mbhY_patchDescriptor);
 		}
 		if(hogInfo.enabled)
 		{
-			hog.QueryPatchDescriptor(rect, hog_patchDescriptor);
+			QueryPatchDescriptor(hog, rect, hog_patchDescriptor);
 		}
+		emittedPatchCount++;
 		
 		if(print)
 		{
@@ -402,28 +1220,106 @@ struct HofMbhBuffer
 		        //float maxTime = *std::max_element(effectiveFrameIndices.begin() , effectiveFrameIndices.end());	
 			//descriptors.append(minTime);
 			//descriptors.append(maxTime);
-			float* ptr_m = patchDescriptor.ptr<float>();
-			for(int i = 0; i < patchDescriptor.size().area(); i++)
-			{
-			descriptors.append(ptr_m[i]);
-			}		
-		
+			sink.Append(patchDescriptor.ptr<float>(), patchDescriptor.size().area());
 		}
 		
 	}
 
-	void PrintFullDescriptor(int blockWidth, int blockHeight, int xStride, int yStride, boost::python::list & descriptors)
+	void PrintFullDescriptor(int blockWidth, int blockHeight, int xStride, int yStride, DescriptorSink& sink)
 	{
+		vector<pair<float, Rect> > candidates;
 		for(int xOffset = 0; xOffset + blockWidth < frameSizeAfterInterpolation.width; xOffset += xStride)
 		{
 			for(int yOffset = 0; yOffset + blockHeight < frameSizeAfterInterpolation.height; yOffset += yStride)
 			{
 				Rect rect(xOffset, yOffset, blockWidth, blockHeight);
-				PrintPatchDescriptor(rect, descriptors);
+				if(IsMotionEnergyPruningEnabled())
+				{
+					float energy = motionEnergy.IsVolumeEnabled()
+						? motionEnergy.QueryWindowEnergy(rect, hofInfo.nxCells, hofInfo.nyCells, windowBegin, ntCells * windowCellLength)
+						: motionEnergy.QueryPatchEnergy(rect, hofInfo.nxCells, hofInfo.nyCells);
+					if(energy < motionEnergyThreshold)
+					{
+						prunedPatchCount++;
+						continue;
+					}
+					if(motionEnergyTopK > 0)
+					{
+						candidates.push_back(make_pair(energy, rect));
+						continue;
+					}
+				}
+				PrintPatchDescriptor(rect, sink);
 				
 			}
 		}
+
+		if(!candidates.empty())
+		{
+			// keep the top-K most moving patches, but emit them in the usual scan order
+			float cutoff = -1;
+			if(candidates.size() > size_t(motionEnergyTopK))
+			{
+				vector<float> energies;
+				for(int i = 0; i < candidates.size(); i++)
+					energies.push_back(candidates[i].first);
+				nth_element(energies.begin(), energies.begin() + motionEnergyTopK - 1, energies.end(), greater<float>());
+				cutoff = energies[motionEnergyTopK - 1];
+			}
+
+			int aboveCutoff = 0;
+			for(int i = 0; i < candidates.size(); i++)
+				aboveCutoff += candidates[i].first > cutoff;
+
+			int tiesLeft = motionEnergyTopK - aboveCutoff;
+			for(int i = 0; i < candidates.size(); i++)
+			{
+				bool keep = candidates[i].first > cutoff || (candidates[i].first == cutoff && tiesLeft-- > 0);
+				if(keep)
+					PrintPatchDescriptor(candidates[i].second, sink);
+				else
+					prunedPatchCount++;
+			}
+		}
+		ResetWindow();
+	}
+
+	// Dense engine: descriptors of every stride-1 patch position of the current window, appended to tensor in one buffer
+	// instead of going patch by patch through PrintFullDescriptor. Motion energy pruning doesn't apply here.
+	void ComputeDenseDescriptors(int blockWidth, int blockHeight, DenseDescriptorTensor& tensor)
+	{
+		int rows = std::max(0, frameSizeAfterInterpolation.height - blockHeight);
+		int cols = std::max(0, frameSizeAfterInterpolation.width - blockWidth);
+		int dim = patchDescriptor.size().area();
+		tensor.rows = rows;
+		tensor.cols = cols;
+		tensor.dim = dim;
+
+		size_t begin = tensor.data.size();
+		tensor.data.resize(begin + size_t(rows)*cols*dim);
+		float* out = tensor.data.empty() ? NULL : &tensor.data[begin];
+		if(rows > 0 && cols > 0)
+		{
+			float* base = patchDescriptor.ptr<float>();
+			if(hogInfo.enabled)
+				hog.QueryDensePatchDescriptors(blockWidth, blockHeight, rows, cols, dim, hog_patchDescriptor - base, out);
+			if(hofInfo.enabled)
+				hof.QueryDensePatchDescriptors(blockWidth, blockHeight, rows, cols, dim, hof_patchDescriptor - base, out);
+			if(mbhInfo.enabled)
+			{
+				mbhX.QueryDensePatchDescriptors(blockWidth, blockHeight, rows, cols, dim, mbhX_patchDescriptor - base, out);
+				mbhY.QueryDensePatchDescriptors(blockWidth, blockHeight, rows, cols, dim, mbhY_patchDescriptor - base, out);
+			}
+		}
+		tensor.windows++;
+		emittedPatchCount += rows*cols;
+	}
+
+	void ResetWindow()
+	{
 		effectiveFrameIndices.clear();
+		effectiveFrameSpan = 0;
+		closedCells = 0;
 	}
 };
 
@@ -0,0 +1,533 @@
+#include <fstream>
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <vector>
+#include <opencv/cv.h>
+
+#include "util.h"
+#include "video.h"
+#include "descriptors.h"
+#include "quantize.h"
+#include "motion_field.h"
+#include "projection.h"
+
+using namespace std;
+using namespace cv;
+
+#ifndef __EXTRACTOR_H__
+#define __EXTRACTOR_H__
+
+struct Options
+{
+	string VideoPath;
+	bool HogEnabled, HofEnabled, MbhEnabled;
+	bool Dense;
+	bool Interpolation;
+	float MotionEnergyThreshold;
+	int MotionEnergyTopK;
+	SamplingPolicy Sampling;
+	int SamplingK;
+	OutputMode Output;
+	bool RootNormalize;
+	bool MeasureQuantizationError;
+	vector<TemporalScale> TemporalScales; // empty for the fixed 3 x 5 frame windows
+	LiveDropPolicy DropPolicy;
+	float MaxLag;
+	shared_ptr<DescriptorProjection> Projection; // reduces descriptors as they are emitted when set
+	int IoBufferSize; // bytes, 0 leaves I/O to the demuxer
+	int ReadAhead; // video packets demuxed ahead of decoding by a thread, 0 reads in line
+
+	vector<int> GoodPts;
+
+	// live sources (pipes, FIFOs, urls) are not checked for existence, opening a FIFO here would block
+	Options(string video, bool live = false)
+	{
+		HogEnabled = false; // off by default, appearance comes from the luma plane at grid resolution
+		HofEnabled = false; //we don't actually use them
+		MbhEnabled = true;
+		Dense = false;
+		Interpolation = false;
+		MotionEnergyThreshold = 0;
+		MotionEnergyTopK = 0;
+		Sampling = SampleAllFrames;
+		SamplingK = 1;
+		Output = OutputFloat32;
+		RootNormalize = false;
+		MeasureQuantizationError = false;
+		DropPolicy = DropBidir;
+		MaxLag = 1;
+		IoBufferSize = FrameReader::defaultIoBufferSize;
+		ReadAhead = 0;
+		VideoPath = video;
+		if(!live && !ifstream(video.c_str()).good())
+			throw runtime_error("Video doesn't exist or can't be opened: " + VideoPath);
+	}
+
+	bool IsQuantizedOutput()
+	{
+		return Output != OutputFloat32 || RootNormalize;
+	}
+
+	static SamplingPolicy ParseSamplingPolicy(string name)
+	{
+		if(name == "all")
+			return SampleAllFrames;
+		if(name == "skip_bidir")
+			return SampleSkipBidir;
+		if(name == "skip_nonref")
+			return SampleSkipNonRef;
+		if(name == "every_kth_p")
+			return SampleEveryKthP;
+		throw runtime_error("Unknown sampling policy: " + name);
+	}
+
+	static OutputMode ParseOutputMode(string name)
+	{
+		if(name == "float32")
+			return OutputFloat32;
+		if(name == "float16")
+			return OutputFloat16;
+		if(name == "uint8")
+			return OutputUint8;
+		throw runtime_error("Unknown output mode: " + name);
+	}
+
+	static LiveDropPolicy ParseDropPolicy(string name)
+	{
+		if(name == "none")
+			return DropNone;
+		if(name == "bidir")
+			return DropBidir;
+		if(name == "nonkey")
+			return DropNonKey;
+		throw runtime_error("Unknown drop policy: " + name);
+	}
+};
+
+// Notified right after the descriptors of each window went into the sink
+struct WindowListener
+{
+	virtual ~WindowListener() {}
+	virtual void OnWindow(float time, double latencyMs, double lagSeconds) = 0;
+};
+
+// Keeps opened decoders and the descriptor buffer alive across the clips of a run, for corpora of many short clips; one session per thread
+struct ExtractionSession
+{
+	DecoderPool Decoders;
+	HofMbhBuffer* buffer;
+	int Clips;
+	int FastOpens;
+	double Seconds; // spent extracting clips, from opening each to its last descriptor
+
+	ExtractionSession() : buffer(NULL), Clips(0), FastOpens(0), Seconds(0)
+	{
+	}
+
+	~ExtractionSession()
+	{
+		delete buffer;
+	}
+
+	HofMbhBuffer& Buffer(DescInfo hogInfo, DescInfo hofInfo, DescInfo mbhInfo, int ntCells, int tStride, Size frameSizeAfterInterpolation, double fscale, int frameCount)
+	{
+		bool compatible = buffer
+			&& buffer->hogInfo.enabled == hogInfo.enabled && buffer->hofInfo.enabled == hofInfo.enabled && buffer->mbhInfo.enabled == mbhInfo.enabled
+			&& buffer->ntCells == ntCells && buffer->tStride == tStride && buffer->fScale == fscale;
+		if(compatible)
+			buffer->Reset(frameSizeAfterInterpolation, frameCount);
+		else
+		{
+			delete buffer;
+			buffer = new HofMbhBuffer(hogInfo, hofInfo, mbhInfo, ntCells, tStride, frameSizeAfterInterpolation, fscale, frameCount, true);
+		}
+		return *buffer;
+	}
+};
+
+// Descriptor geometry shared by every extraction: ntCells temporal cells of tStride frames, 32 and 48 pixel patches
+struct ExtractionLayout
+{
+	static const int ntCells = 3;
+	static const int tStride = 5;
+	vector<Size> patchSizes;
+	DescInfo hofInfo, mbhInfo, hogInfo;
+	Size frameSizeAfterInterpolation;
+	int cellSize;
+	double fscale;
+
+	ExtractionLayout(Options& opts, Size downsampledFrameSize, Size originalFrameSize) :
+		hofInfo(HofInfo(opts)),
+		mbhInfo(MbhInfo(opts)),
+		hogInfo(HogInfo(opts)),
+		fscale(1 / 8.0)
+	{
+		patchSizes.push_back(Size(32, 32));
+		patchSizes.push_back(Size(48, 48));
+		frameSizeAfterInterpolation =
+			opts.Interpolation
+				? Size(2*downsampledFrameSize.width - 1, 2*downsampledFrameSize.height - 1)
+				: downsampledFrameSize;
+		cellSize = originalFrameSize.width / frameSizeAfterInterpolation.width;
+	}
+
+	static DescInfo HofInfo(Options& opts) { return DescInfo(8+1, true, ntCells, opts.HofEnabled); }
+	static DescInfo MbhInfo(Options& opts) { return DescInfo(8, false, ntCells, opts.MbhEnabled); }
+	static DescInfo HogInfo(Options& opts) { return DescInfo(8, false, ntCells, opts.HogEnabled); }
+
+	// Dimensions of the channels of a descriptor row in emission order: hog, hof, mbh-x, mbh-y, as far as enabled
+	static vector<int> ChannelDims(Options& opts)
+	{
+		vector<int> channels;
+		if(opts.HogEnabled)
+			channels.push_back(HogInfo(opts).fullDim);
+		if(opts.HofEnabled)
+			channels.push_back(HofInfo(opts).fullDim);
+		if(opts.MbhEnabled)
+		{
+			channels.push_back(MbhInfo(opts).fullDim);
+			channels.push_back(MbhInfo(opts).fullDim);
+		}
+		return channels;
+	}
+
+	HofMbhBuffer* NewBuffer(Options& opts, int frameCount)
+	{
+		HofMbhBuffer* buffer = new HofMbhBuffer(hogInfo, hofInfo, mbhInfo, ntCells, tStride, frameSizeAfterInterpolation, fscale, frameCount, true);
+		Configure(*buffer, opts);
+		return buffer;
+	}
+
+	void Configure(HofMbhBuffer& buffer, Options& opts)
+	{
+		buffer.EnableMotionEnergyPruning(opts.MotionEnergyThreshold, opts.MotionEnergyTopK);
+		if(!opts.TemporalScales.empty())
+			buffer.EnableTemporalScales(opts.TemporalScales);
+	}
+
+	// The window buffer just completed, all patch sizes, once per ready temporal scale
+	void EmitWindow(HofMbhBuffer& buffer, Options& opts, float time, DescriptorSink& out)
+	{
+		out.BeginWindow(time);
+		int scales = opts.TemporalScales.empty() ? 1 : buffer.ReadyScales.size();
+		for(int i = 0; i < scales; i++)
+		{
+			if(!opts.TemporalScales.empty())
+			{
+				buffer.SelectScale(buffer.ReadyScales[i]);
+				out.SelectScale(buffer.ReadyScales[i]);
+			}
+			for(int k = 0; k < patchSizes.size(); k++)
+			{
+				int blockWidth = patchSizes[k].width / cellSize;
+				int blockHeight = patchSizes[k].height / cellSize;
+				int xStride = opts.Dense ? 1 : blockWidth / 2;
+				int yStride = opts.Dense ? 1 : blockHeight / 2;
+				buffer.PrintFullDescriptor(blockWidth, blockHeight, xStride, yStride, out);
+			}
+		}
+		out.Flush();
+	}
+};
+
+// Reads the [start, end] time range from rdr (a FrameReader or a MotionFieldReader) and emits the descriptors of all its windows into sink,
+// or, when denseTensors is given, into one dense tensor per patch size. A listener hears about every window as soon as it is emitted.
+template<typename Reader>
+void ExtractDescriptorsFrom(Reader& rdr, Options& opts, double start, double end, DescriptorSink& sink, ExtractionStats& stats,
+	vector<DenseDescriptorTensor>* denseTensors = NULL, WindowListener* listener = NULL, ExtractionSession* session = NULL)
+{
+	setNumThreads(1);
+	ExtractionLayout layout(opts, rdr.DownsampledFrameSize, rdr.OriginalFrameSize);
+	vector<Size>& patchSizes = layout.patchSizes;
+	int cellSize = layout.cellSize;
+
+	float time = -1;
+	Frame frame;
+	if(denseTensors && opts.Projection)
+		throw runtime_error("The dense engine doesn't support projections");
+	if(denseTensors && !opts.TemporalScales.empty())
+		throw runtime_error("The dense engine doesn't support temporal scales");
+	unique_ptr<HofMbhBuffer> ownBuffer(session ? NULL : layout.NewBuffer(opts, rdr.frameCount));
+	if(session)
+		layout.Configure(session->Buffer(layout.hogInfo, layout.hofInfo, layout.mbhInfo, layout.ntCells, layout.tStride, layout.frameSizeAfterInterpolation, layout.fscale, rdr.frameCount), opts);
+	HofMbhBuffer& buffer = session ? *session->buffer : *ownBuffer;
+	unique_ptr<ProjectingSink> projectingSink(opts.Projection ? new ProjectingSink(*opts.Projection, sink) : NULL);
+	DescriptorSink& out = projectingSink ? *projectingSink : sink;
+
+	// we read and discard until we get to the start frame
+	while(time < start){
+		frame = rdr.Read();
+		if (frame.PTS == -1){
+//			descriptors.append(-3.);
+			break;
+		}
+		time = rdr.time;
+	}
+	while(true){
+		frame = rdr.Read();
+		if (frame.PTS == -1) {
+//		    	descriptors.append(-1.);
+			break;
+		}
+		else if (rdr.time > end){
+			//rdr.release();
+//			descriptors.append(-2.);
+			break;
+		}
+		if(frame.NoMotionVectors || (layout.hogInfo.enabled && frame.RawImage.empty())){
+			continue;
+		}
+
+		stats.SampledFrames[frame.PictType]++;
+		stats.SkippedFrames += frame.FrameSpan - 1;
+		frame.Interpolate(layout.frameSizeAfterInterpolation, layout.fscale);
+		buffer.Update(frame, rdr.time, 1, frame.FrameSpan);
+		if(buffer.AreDescriptorsReady && denseTensors)
+		{
+			if(denseTensors->empty())
+				for(int k = 0; k < patchSizes.size(); k++)
+					denseTensors->push_back(DenseDescriptorTensor(patchSizes[k]));
+			for(int k = 0; k < patchSizes.size(); k++)
+				buffer.ComputeDenseDescriptors(patchSizes[k].width / cellSize, patchSizes[k].height / cellSize, (*denseTensors)[k]);
+			buffer.ResetWindow();
+		}
+		else if(buffer.AreDescriptorsReady)
+			layout.EmitWindow(buffer, opts, rdr.time, out);
+
+		if(buffer.AreDescriptorsReady && listener)
+		{
+			double latencyMs = (av_gettime_relative() - frame.ArrivalTime) / 1000.0;
+			stats.RecordLatency(latencyMs, frame.Lag);
+			listener->OnWindow(rdr.time, latencyMs, frame.Lag);
+		}
+	}
+
+	stats.CpuLevel = ActiveKernels()->Name;
+	out.Flush();
+	stats.DescriptorDim = opts.Projection ? opts.Projection->OutputDim() : buffer.patchDescriptor.size().area();
+	stats.EmittedPatches = buffer.emittedPatchCount;
+	stats.PrunedPatches = buffer.prunedPatchCount;
+}
+
+// I/O counters of a finished read, to tune buffer size and read-ahead per storage tier. The read-ahead thread is joined first,
+// it drives the demuxer and its byte counters until then.
+void RecordIo(FrameReader& rdr, ExtractionStats& stats)
+{
+	rdr.StopReadAhead();
+	stats.BytesRead += rdr.BytesRead();
+	stats.IoMs += rdr.input.IoMicroseconds / 1000.0;
+	stats.ReadStallMs += rdr.readStallMicroseconds / 1000.0;
+}
+
+// Decodes the [start, end] time range of opts.VideoPath and emits the descriptors of all its windows into sink
+void ExtractDescriptors(Options& opts, double start, double end, DescriptorSink& sink, ExtractionStats& stats,
+	vector<DenseDescriptorTensor>* denseTensors = NULL, ExtractionSession* session = NULL)
+{
+	int64_t begin = av_gettime_relative();
+	FrameReader rdr(opts.VideoPath.c_str(), false, session ? &session->Decoders : NULL, opts.IoBufferSize);
+	rdr.SetSamplingPolicy(opts.Sampling, opts.SamplingK);
+	rdr.SetAppearanceEnabled(opts.HogEnabled);
+	rdr.StartReadAhead(opts.ReadAhead);
+	if(session)
+	{
+		session->Clips++;
+		session->FastOpens += rdr.FastOpened;
+	}
+	ExtractDescriptorsFrom(rdr, opts, start, end, sink, stats, denseTensors, NULL, session);
+	RecordIo(rdr, stats);
+	if(session)
+		session->Seconds += (av_gettime_relative() - begin) / 1e6;
+}
+
+// One [start, end] range of a multi-range extraction, with its own buffer and sink
+struct RangeExtraction
+{
+	double start, end;
+	unique_ptr<HofMbhBuffer> buffer;
+	unique_ptr<ProjectingSink> projectingSink;
+	DescriptorSink* out;
+	bool started; // the first frame at or past start went by, skipped like ExtractDescriptors skips it
+	bool done;
+};
+
+// Ranges whose start is further than this (seconds) past the current position are reached by a keyframe seek, closer ones by decoding on
+const double rangeSeekGap = 2;
+
+// Serves several [start, end] ranges of opts.VideoPath, overlapping or not, in one forward decode: every frame goes to the buffer of each
+// range it falls in, and the reader seeks to the keyframe before the next range instead of decoding a long gap. Each range gets into
+// sinks[i] the descriptors of its own ExtractDescriptors call; stats sums over the ranges.
+void ExtractDescriptorRanges(Options& opts, const vector<pair<double, double> >& ranges, vector<DescriptorSink*>& sinks, ExtractionStats& stats)
+{
+	setNumThreads(1);
+	FrameReader rdr(opts.VideoPath.c_str(), false, NULL, opts.IoBufferSize);
+	rdr.SetSamplingPolicy(opts.Sampling, opts.SamplingK);
+	rdr.SetAppearanceEnabled(opts.HogEnabled);
+	rdr.StartReadAhead(opts.ReadAhead);
+	ExtractionLayout layout(opts, rdr.DownsampledFrameSize, rdr.OriginalFrameSize);
+
+	vector<RangeExtraction> extractions(ranges.size());
+	vector<int> order;
+	for(int i = 0; i < ranges.size(); i++)
+	{
+		RangeExtraction& r = extractions[i];
+		r.start = ranges[i].first;
+		r.end = ranges[i].second;
+		r.buffer.reset(layout.NewBuffer(opts, rdr.frameCount));
+		r.projectingSink.reset(opts.Projection ? new ProjectingSink(*opts.Projection, *sinks[i]) : NULL);
+		r.out = r.projectingSink ? r.projectingSink.get() : sinks[i];
+		r.started = r.done = false;
+		order.push_back(i);
+	}
+	sort(order.begin(), order.end(), [&](int a, int b) { return ranges[a].first < ranges[b].first; });
+
+	int nextStart = 0; // first range in start order that hasn't started
+	int seekedFor = -1;
+	while(true)
+	{
+		while(nextStart < order.size() && extractions[order[nextStart]].started)
+			nextStart++;
+		bool active = false;
+		for(int i = 0; i < extractions.size(); i++)
+			active = active || (extractions[i].started && !extractions[i].done);
+		if(!active && nextStart == order.size())
+			break;
+		if(!active && seekedFor != nextStart && extractions[order[nextStart]].start - rdr.time > rangeSeekGap)
+		{
+			rdr.SeekBackTo(extractions[order[nextStart]].start);
+			seekedFor = nextStart;
+		}
+
+		Frame frame = rdr.Read();
+		if(frame.PTS == -1)
+			break;
+
+		bool interpolated = false;
+		for(int i = 0; i < extractions.size(); i++)
+		{
+			RangeExtraction& r = extractions[i];
+			if(r.done)
+				continue;
+			if(!r.started)
+			{
+				r.started = rdr.time >= r.start;
+				continue;
+			}
+			if(rdr.time > r.end)
+			{
+				r.done = true;
+				continue;
+			}
+			if(frame.NoMotionVectors || (layout.hogInfo.enabled && frame.RawImage.empty()))
+				continue;
+
+			stats.SampledFrames[frame.PictType]++;
+			stats.SkippedFrames += frame.FrameSpan - 1;
+			if(!interpolated)
+				frame.Interpolate(layout.frameSizeAfterInterpolation, layout.fscale);
+			interpolated = true;
+			r.buffer->Update(frame, rdr.time, 1, frame.FrameSpan);
+			if(r.buffer->AreDescriptorsReady)
+				layout.EmitWindow(*r.buffer, opts, rdr.time, *r.out);
+		}
+	}
+
+	stats.CpuLevel = ActiveKernels()->Name;
+	for(int i = 0; i < extractions.size(); i++)
+	{
+		extractions[i].out->Flush();
+		stats.EmittedPatches += extractions[i].buffer->emittedPatchCount;
+		stats.PrunedPatches += extractions[i].buffer->prunedPatchCount;
+		stats.DescriptorDim = opts.Projection ? opts.Projection->OutputDim() : extractions[i].buffer->patchDescriptor.size().area();
+	}
+	RecordIo(rdr, stats);
+}
+
+// Packets a live reader demuxes ahead of decoding when opts.ReadAhead doesn't say otherwise: the source is drained as data comes in,
+// so latency is measured from arrival rather than from the moment the decoder got around to the packet
+const int liveReadAhead = 256;
+
+// Consumes an unbounded live source until it ends, handing every window to listener as soon as it completes. Without explicit
+// temporal scales the run uses a single (5, 5) scale of its own, so a window completes every tStride frames rather than every
+// ntCells x tStride; motion energy pruning works on it like on the fixed windows. The reader drops frames by options.DropPolicy
+// when it lags more than options.MaxLag. Temporal scales count source frames, dropped ones included.
+void ExtractLiveDescriptors(const Options& options, DescriptorSink& sink, WindowListener& listener, ExtractionStats& stats)
+{
+	Options opts = options;
+	if(opts.TemporalScales.empty())
+		opts.TemporalScales.push_back(TemporalScale(5, 5));
+
+	FrameReader rdr(opts.VideoPath.c_str(), true);
+	rdr.SetSamplingPolicy(opts.Sampling, opts.SamplingK);
+	rdr.SetAppearanceEnabled(opts.HogEnabled);
+	rdr.SetLiveDropPolicy(opts.DropPolicy, opts.MaxLag);
+	rdr.StartReadAhead(opts.ReadAhead > 0 ? opts.ReadAhead : liveReadAhead);
+	ExtractDescriptorsFrom(rdr, opts, -1, numeric_limits<double>::max(), sink, stats, NULL, &listener);
+	RecordIo(rdr, stats);
+}
+
+// Same as ExtractDescriptors, but from a motion field file written by ExportMotionField instead of the video. The file has no luma,
+// so HOG can't be computed from it.
+void ExtractDescriptorsFromMotionField(Options& opts, double start, double end, DescriptorSink& sink, ExtractionStats& stats)
+{
+	if(opts.HogEnabled)
+		throw runtime_error("HOG needs the video's luma, a motion field file only has motion vectors; disable hog for motion field input");
+	MotionFieldReader rdr(opts.VideoPath.c_str());
+	ExtractDescriptorsFrom(rdr, opts, start, end, sink, stats);
+}
+
+// Decodes the [start, end] time range of opts.VideoPath and keeps its motion vector grids in a motion field file (unless path is empty) and/or in array.
+// Returns the grid size.
+Size ExportMotionField(Options& opts, double start, double end, string path, MotionFieldArray* array, ExtractionStats& stats)
+{
+	FrameReader rdr(opts.VideoPath.c_str(), false, NULL, opts.IoBufferSize);
+	rdr.SetSamplingPolicy(opts.Sampling, opts.SamplingK);
+	rdr.StartReadAhead(opts.ReadAhead);
+
+	MotionFieldHeader header;
+	header.gridWidth = rdr.DownsampledFrameSize.width;
+	header.gridHeight = rdr.DownsampledFrameSize.height;
+	header.width = rdr.OriginalFrameSize.width;
+	header.height = rdr.OriginalFrameSize.height;
+	header.frameCount = rdr.frameCount;
+	header.fps = rdr.fps;
+	MotionFieldWriter* writer = path.empty() ? NULL : new MotionFieldWriter(path.c_str(), header);
+
+	try
+	{
+		float time = -1;
+		Frame frame;
+		while(time < start){
+			frame = rdr.Read();
+			if (frame.PTS == -1)
+				break;
+			time = rdr.time;
+		}
+		while(true){
+			frame = rdr.Read();
+			if (frame.PTS == -1 || rdr.time > end)
+				break;
+
+			frame.width = rdr.width;
+			frame.height = rdr.height;
+			stats.SampledFrames[frame.PictType]++;
+			stats.SkippedFrames += frame.FrameSpan - 1;
+			if(writer)
+				writer->Write(frame, rdr.time);
+			if(array)
+				array->Append(frame, rdr.time, rdr.DownsampledFrameSize);
+		}
+	}
+	catch(...)
+	{
+		delete writer;
+		throw;
+	}
+	delete writer;
+	RecordIo(rdr, stats);
+	return rdr.DownsampledFrameSize;
+}
+
+#endif
@@ -0,0 +1,91 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#include "kernels.h"
+
+#ifndef __KERNEL_REGISTRY_H__
+#define __KERNEL_REGISTRY_H__
+
+enum CpuLevel
+{
+	CpuGeneric,
+	CpuSse42,
+	CpuAvx2,
+	CpuAvx512
+};
+
+const KernelTable* KernelsForLevel(CpuLevel level)
+{
+	switch(level)
+	{
+		case CpuAvx512: return &Avx512Kernels;
+		case CpuAvx2: return &Avx2Kernels;
+		case CpuSse42: return &Sse42Kernels;
+		default: return &GenericKernels;
+	}
+}
+
+CpuLevel DetectCpuLevel()
+{
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx512f"))
+		return CpuAvx512;
+	if(__builtin_cpu_supports("avx2"))
+		return CpuAvx2;
+	if(__builtin_cpu_supports("sse4.2"))
+		return CpuSse42;
+#endif
+	return CpuGeneric;
+}
+
+CpuLevel ParseCpuLevel(std::string name)
+{
+	if(name == "generic")
+		return CpuGeneric;
+	if(name == "sse4.2")
+		return CpuSse42;
+	if(name == "avx2")
+		return CpuAvx2;
+	if(name == "avx512")
+		return CpuAvx512;
+	throw std::runtime_error("Unknown cpu level: " + name);
+}
+
+// Best level the cpu supports, unless MPEGFLOW_CPU_LEVEL forces one (for testing, it can only lower the level)
+const KernelTable* SelectKernels()
+{
+	CpuLevel level = DetectCpuLevel();
+	const char* forced = getenv("MPEGFLOW_CPU_LEVEL");
+	if(forced && *forced)
+	{
+		try
+		{
+			level = std::min(level, ParseCpuLevel(forced));
+		}
+		catch(std::runtime_error& e)
+		{
+			fprintf(stderr, "Ignoring MPEGFLOW_CPU_LEVEL: %s\n", e.what());
+		}
+	}
+	return KernelsForLevel(level);
+}
+
+const KernelTable* activeKernels = SelectKernels();
+
+const KernelTable* ActiveKernels()
+{
+	return activeKernels;
+}
+
+// Forces a level at runtime; levels the cpu doesn't support are clamped to the best supported one
+void SetCpuLevel(std::string name)
+{
+	activeKernels = KernelsForLevel(std::min(DetectCpuLevel(), ParseCpuLevel(name)));
+}
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+// Hot loops of the descriptor computation on plain float arrays. kernels_impl.h is compiled once per instruction set level,
+// each in its own translation unit with its own target flags, and kernel_registry.h picks the best table at load time.
+
+struct OrientationBinningParams
+{
+	int nBins;
+	int angleBins; // nBins without the no-motion bin when thresholding is applied
+	bool applyThresholding;
+	float threshold;
+	float fullAngle;
+	float invAngleBase;
+};
+
+struct KernelTable
+{
+	const char* Name;
+
+	// splits every (dx, dy) of a row between two neighbouring orientation bins, weighted by magnitude
+	void (*BinOrientations)(const float* dx, const float* dy, int n, const OrientationBinningParams& params, int* bin0, int* bin1, float* w0, float* w1);
+
+	// writes one row of the orientation integral transform: running per-bin sums along the row plus the previous row (NULL for the first one)
+	void (*AccumulateIntegralRow)(const int* bin0, const int* bin1, const float* w0, const float* w1, int width, int nBins, const float* prevRow, float* row);
+
+	// same as AccumulateIntegralRow for a row whose only moving cells are cols[0..count); every other cell adds stillWeight to stillBin
+	void (*AccumulateSparseIntegralRow)(const int* cols, const int* bin0, const int* bin1, const float* w0, const float* w1, int count,
+		int width, int nBins, int stillBin, float stillWeight, const float* prevRow, float* row);
+
+	// 1-tap Sobel derivatives in x and y with reflect-101 borders, same as cv::Sobel with ksize 1
+	void (*CentralDifferences)(const float* src, int rows, int cols, float* dx, float* dy);
+
+	void (*NormalizeL2)(float* v, int n);
+
+	// out_r = bias + W x_r for a batch of rows, W stored transposed as inputDim x outputDim
+	void (*ProjectRows)(const float* x, int xStride, int rows, int inputDim, const float* weightsT, const float* bias, int outputDim, float* out, int outStride);
+};
+
+extern const KernelTable GenericKernels;
+extern const KernelTable Sse42Kernels;
+extern const KernelTable Avx2Kernels;
+extern const KernelTable Avx512Kernels;
+
+#endif
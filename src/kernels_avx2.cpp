@@ -0,0 +1,4 @@
+#define KERNEL_NAMESPACE avx2
+#define KERNEL_TABLE Avx2Kernels
+#define KERNEL_LEVEL_NAME "avx2"
+#include "kernels_impl.h"
@@ -0,0 +1,4 @@
+#define KERNEL_NAMESPACE avx512
+#define KERNEL_TABLE Avx512Kernels
+#define KERNEL_LEVEL_NAME "avx512"
+#include "kernels_impl.h"
@@ -0,0 +1,4 @@
+#define KERNEL_NAMESPACE generic
+#define KERNEL_TABLE GenericKernels
+#define KERNEL_LEVEL_NAME "generic"
+#include "kernels_impl.h"
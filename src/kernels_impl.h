@@ -0,0 +1,227 @@
+#include <cmath>
+#include <cfloat>
+#include <cstdlib>
+
+#include "kernels.h"
+
+// Included by every kernels_<level>.cpp with KERNEL_NAMESPACE, KERNEL_TABLE and KERNEL_LEVEL_NAME defined.
+// Loops are written branch-free so the compiler vectorizes them for whatever target flags the including file is built with.
+
+namespace KERNEL_NAMESPACE
+{
+
+// same polynomial as OpenCV's fastAtan2, in degrees
+static inline float FastAtan2(float y, float x)
+{
+	const double pi = 3.1415926535897932384626433832795;
+	const float p1 = 0.9997878412794807f*(float)(180/pi);
+	const float p3 = -0.3258083974640975f*(float)(180/pi);
+	const float p5 = 0.1555786518463281f*(float)(180/pi);
+	const float p7 = -0.04432655554792128f*(float)(180/pi);
+
+	float ax = std::fabs(x), ay = std::fabs(y);
+	bool xMajor = ax >= ay;
+	float c = (xMajor ? ay : ax)/((xMajor ? ax : ay) + (float)DBL_EPSILON);
+	float c2 = c*c;
+	float a = (((p7*c2 + p5)*c2 + p3)*c2 + p1)*c;
+	a = xMajor ? a : 90.f - a;
+	a = x < 0 ? 180.f - a : a;
+	a = y < 0 ? 360.f - a : a;
+	return a;
+}
+
+static void BinOrientations(const float* dx, const float* dy, int n, const OrientationBinningParams& params, int* bin0, int* bin1, float* w0, float* w1)
+{
+	const int angleBins = params.angleBins;
+	const float fullAngle = params.fullAngle;
+	const float invAngleBase = params.invAngleBase;
+	const float threshold = params.applyThresholding ? params.threshold : -1;
+
+	for(int j = 0; j < n; j++)
+	{
+		float shiftX = dx[j];
+		float shiftY = dy[j];
+		float m = std::sqrt(shiftX*shiftX + shiftY*shiftY);
+
+		float orientation = FastAtan2(shiftY, shiftX);
+		orientation = orientation > fullAngle ? orientation - fullAngle : orientation;
+		float fbin = orientation * invAngleBase;
+		int b0 = (int)std::floor(fbin);
+		float m1 = (fbin - b0)*m;
+		b0 = b0 >= angleBins ? b0 - angleBins : b0; // fullAngle itself is orientation 0
+		int b1 = b0 + 1 >= angleBins ? b0 + 1 - angleBins : b0 + 1;
+
+		bool still = m <= threshold;
+		bin0[j] = still ? angleBins : b0;
+		bin1[j] = still ? 0 : b1;
+		w0[j] = still ? 1.0f : m - m1;
+		w1[j] = still ? 0.0f : m1;
+	}
+}
+
+static void AccumulateIntegralRow(const int* bin0, const int* bin1, const float* w0, const float* w1, int width, int nBins, const float* prevRow, float* row)
+{
+	float sum[64] = {0}; // nBins is at most 9 for the descriptors we compute
+	for(int j = 0; j < width; j++)
+	{
+		sum[bin0[j]] += w0[j];
+		sum[bin1[j]] += w1[j];
+		float* cell = row + j*nBins;
+		for(int m = 0; m < nBins; m++)
+			cell[m] = sum[m];
+	}
+
+	if(prevRow)
+	{
+		int n = width*nBins;
+		for(int k = 0; k < n; k++)
+			row[k] = prevRow[k] + row[k];
+	}
+}
+
+static void AccumulateSparseIntegralRow(const int* cols, const int* bin0, const int* bin1, const float* w0, const float* w1, int count,
+	int width, int nBins, int stillBin, float stillWeight, const float* prevRow, float* row)
+{
+	float sum[64] = {0};
+	for(int k = 0, j = 0; k <= count; k++)
+	{
+		int next = k < count ? cols[k] : width;
+		if(stillWeight == 0)
+		{
+			// still cells leave the running sums alone, the whole run repeats them
+			for(; j < next; j++)
+			{
+				float* cell = row + j*nBins;
+				for(int m = 0; m < nBins; m++)
+					cell[m] = sum[m];
+			}
+		}
+		else
+		{
+			for(; j < next; j++)
+			{
+				sum[stillBin] += stillWeight;
+				float* cell = row + j*nBins;
+				for(int m = 0; m < nBins; m++)
+					cell[m] = sum[m];
+			}
+		}
+
+		if(k < count)
+		{
+			sum[bin0[k]] += w0[k];
+			sum[bin1[k]] += w1[k];
+			float* cell = row + j*nBins;
+			for(int m = 0; m < nBins; m++)
+				cell[m] = sum[m];
+			j++;
+		}
+	}
+
+	if(prevRow)
+	{
+		int n = width*nBins;
+		for(int k = 0; k < n; k++)
+			row[k] = prevRow[k] + row[k];
+	}
+}
+
+static void CentralDifferences(const float* src, int rows, int cols, float* dx, float* dy)
+{
+	for(int i = 0; i < rows; i++)
+	{
+		const float* cur = src + i*cols;
+		float* outX = dx + i*cols;
+		outX[0] = 0;
+		for(int j = 1; j < cols - 1; j++)
+			outX[j] = cur[j+1] - cur[j-1];
+		outX[cols-1] = 0;
+
+		// reflect-101 makes both border rows zero, like the border columns
+		float* outY = dy + i*cols;
+		if(i == 0 || i == rows - 1)
+		{
+			for(int j = 0; j < cols; j++)
+				outY[j] = 0;
+		}
+		else
+		{
+			const float* up = cur - cols;
+			const float* down = cur + cols;
+			for(int j = 0; j < cols; j++)
+				outY[j] = down[j] - up[j];
+		}
+	}
+}
+
+static void NormalizeL2(float* v, int n)
+{
+	float sumSq = 0;
+	for(int k = 0; k < n; k++)
+		sumSq += v[k]*v[k];
+
+	float inv = 1 / std::sqrt(sumSq);
+	for(int k = 0; k < n; k++)
+		v[k] *= inv;
+}
+
+// out_r = bias + W x_r for every row, with W given transposed (inputDim x outputDim). Rows go four at a time so each row of W
+// is loaded once per block, and the inner loop runs over contiguous outputs.
+static void ProjectRows(const float* x, int xStride, int rows, int inputDim, const float* weightsT, const float* bias, int outputDim, float* out, int outStride)
+{
+	int r = 0;
+	for(; r + 4 <= rows; r += 4)
+	{
+		const float* x0 = x + r*xStride;
+		const float* x1 = x0 + xStride;
+		const float* x2 = x1 + xStride;
+		const float* x3 = x2 + xStride;
+		float* out0 = out + r*outStride;
+		float* out1 = out0 + outStride;
+		float* out2 = out1 + outStride;
+		float* out3 = out2 + outStride;
+		for(int o = 0; o < outputDim; o++)
+			out0[o] = out1[o] = out2[o] = out3[o] = bias[o];
+
+		for(int i = 0; i < inputDim; i++)
+		{
+			const float* w = weightsT + i*outputDim;
+			float a0 = x0[i], a1 = x1[i], a2 = x2[i], a3 = x3[i];
+			for(int o = 0; o < outputDim; o++)
+			{
+				out0[o] += a0*w[o];
+				out1[o] += a1*w[o];
+				out2[o] += a2*w[o];
+				out3[o] += a3*w[o];
+			}
+		}
+	}
+
+	for(; r < rows; r++)
+	{
+		const float* x0 = x + r*xStride;
+		float* out0 = out + r*outStride;
+		for(int o = 0; o < outputDim; o++)
+			out0[o] = bias[o];
+		for(int i = 0; i < inputDim; i++)
+		{
+			const float* w = weightsT + i*outputDim;
+			float a0 = x0[i];
+			for(int o = 0; o < outputDim; o++)
+				out0[o] += a0*w[o];
+		}
+	}
+}
+
+}
+
+extern const KernelTable KERNEL_TABLE =
+{
+	KERNEL_LEVEL_NAME,
+	KERNEL_NAMESPACE::BinOrientations,
+	KERNEL_NAMESPACE::AccumulateIntegralRow,
+	KERNEL_NAMESPACE::AccumulateSparseIntegralRow,
+	KERNEL_NAMESPACE::CentralDifferences,
+	KERNEL_NAMESPACE::NormalizeL2,
+	KERNEL_NAMESPACE::ProjectRows
+};
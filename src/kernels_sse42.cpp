@@ -0,0 +1,4 @@
+#define KERNEL_NAMESPACE sse42
+#define KERNEL_TABLE Sse42Kernels
+#define KERNEL_LEVEL_NAME "sse4.2"
+#include "kernels_impl.h"
@@ -8,6 +8,8 @@
 #include "util.h"
 #include "video.h"
 #include "descriptors.h"
+#include "extractor.h"
+#include "shm_ring.h"
 #include <iterator>
 #include <vector>
 #include <boost/python.hpp>
@@ -17,94 +19,585 @@ using namespace boost::python;
 using namespace std;
 using namespace cv;
 
-struct Options
+template<typename T>
+void ReadOption(dict& overrides, const char* key, T& value)
 {
-	string VideoPath;
-	bool HogEnabled, HofEnabled, MbhEnabled;
-	bool Dense;
-	bool Interpolation;
+	if(overrides.has_key(key))
+		value = extract<T>(overrides[key]);
+}
+
+Options ParseOptions(string video, dict overrides, bool live = false)
+{
+	Options opts(video, live);
+	ReadOption(overrides, "hog", opts.HogEnabled);
+	ReadOption(overrides, "hof", opts.HofEnabled);
+	ReadOption(overrides, "mbh", opts.MbhEnabled);
+	ReadOption(overrides, "motion_energy_threshold", opts.MotionEnergyThreshold);
+	ReadOption(overrides, "motion_energy_top_k", opts.MotionEnergyTopK);
+	ReadOption(overrides, "sampling_k", opts.SamplingK);
+	if(overrides.has_key("sampling"))
+		opts.Sampling = Options::ParseSamplingPolicy(extract<string>(overrides["sampling"]));
+	ReadOption(overrides, "root_normalize", opts.RootNormalize);
+	ReadOption(overrides, "measure_quantization_error", opts.MeasureQuantizationError);
+	if(overrides.has_key("output"))
+		opts.Output = Options::ParseOutputMode(extract<string>(overrides["output"]));
+	if(overrides.has_key("drop_policy"))
+		opts.DropPolicy = Options::ParseDropPolicy(extract<string>(overrides["drop_policy"]));
+	ReadOption(overrides, "max_lag", opts.MaxLag);
+	if(overrides.has_key("io_buffer_kb"))
+		opts.IoBufferSize = extract<int>(overrides["io_buffer_kb"]) * 1024;
+	ReadOption(overrides, "read_ahead", opts.ReadAhead);
+	if(overrides.has_key("projection"))
+		opts.Projection = make_shared<DescriptorProjection>(DescriptorProjection::Load(extract<string>(overrides["projection"])));
+	// projected components are signed and unbounded, which the quantized formats and root normalization assume they aren't
+	if(opts.Projection && opts.IsQuantizedOutput())
+		throw runtime_error("Projections only support float32 output without root normalization");
+	if(overrides.has_key("temporal_scales"))
+	{
+		// [(cell_length, window_stride), ...] in source frames, skipped and dropped ones included
+		list scales = extract<list>(overrides["temporal_scales"]);
+		for(int i = 0; i < len(scales); i++)
+			opts.TemporalScales.push_back(TemporalScale(extract<int>(scales[i][0]), extract<int>(scales[i][1])));
+	}
+	return opts;
+}
 
-	vector<int> GoodPts;
+ExtractionStats lastStats;
 
-	Options(string video)
+// Descriptors of one extraction as run returns them: with temporal scales one entry per scale, each shaped like the single-scale result,
+// a list of floats or, quantized, a single bytes object of emitted_patches x descriptor_dim values
+struct PythonResult
+{
+	vector<list> scaleDescriptors;
+	vector<QuantizedDescriptorSink> quantizedSinks;
+	vector<PythonListSink> listSinks;
+	unique_ptr<MultiScaleSink> sink;
+
+	PythonResult(Options& opts)
 	{
-		HogEnabled = false; // we don't actually use them
-		HofEnabled = false; //we don't actually use them
-		MbhEnabled = true;
-		Dense = false;
-		Interpolation = false;
-		VideoPath = video;
-		if(!ifstream(video.c_str()).good())
-			throw runtime_error("Video doesn't exist or can't be opened: " + VideoPath);
+		int scaleCount = std::max<int>(1, opts.TemporalScales.size());
+		scaleDescriptors.resize(scaleCount);
+		vector<DescriptorSink*> sinks;
+		for(int s = 0; s < scaleCount; s++)
+		{
+			if(opts.IsQuantizedOutput())
+				quantizedSinks.push_back(QuantizedDescriptorSink(opts.Output, opts.RootNormalize, ExtractionLayout::ChannelDims(opts), opts.MeasureQuantizationError));
+			else
+				listSinks.push_back(PythonListSink(scaleDescriptors[s]));
+		}
+		for(int s = 0; s < scaleCount; s++)
+			sinks.push_back(opts.IsQuantizedOutput() ? (DescriptorSink*)&quantizedSinks[s] : (DescriptorSink*)&listSinks[s]);
+		sink.reset(new MultiScaleSink(sinks));
+	}
+
+	list Finish(Options& opts, QuantizationError& error)
+	{
+		for(int s = 0; s < quantizedSinks.size(); s++)
+		{
+			QuantizedDescriptorSink& quantized = quantizedSinks[s];
+			const char* data = quantized.data.empty() ? "" : (const char*)&quantized.data[0];
+			scaleDescriptors[s].append(object(handle<>(PyBytes_FromStringAndSize(data, quantized.data.size()))));
+			error.sumAbs += quantized.error.sumAbs;
+			error.count += quantized.error.count;
+			error.maxAbs = std::max(error.maxAbs, quantized.error.maxAbs);
+		}
+
+		if(opts.TemporalScales.empty())
+			return scaleDescriptors[0];
+		list descriptors;
+		for(int s = 0; s < scaleDescriptors.size(); s++)
+			descriptors.append(scaleDescriptors[s]);
+		return descriptors;
 	}
 };
 
-list get_descriptors(string video, double start =0, double end =-1)
+list RunExtraction(Options& opts, double start, double end, bool fromMotionField, ExtractionSession* session = NULL)
 {
-	Options opts(video);
-	setNumThreads(1);
-	const int nt_cell = 3;
-	const int tStride = 5;
-	vector<Size> patchSizes;
-	patchSizes.push_back(Size(32, 32));
-	patchSizes.push_back(Size(48, 48));
-
-	DescInfo hofInfo(8+1, true, nt_cell, opts.HofEnabled);
-	DescInfo mbhInfo(8, false, nt_cell, opts.MbhEnabled);
-	DescInfo hogInfo(8, false, nt_cell, opts.HogEnabled);
-
-	float time = -1;
-	FrameReader rdr(video.c_str());
-	Frame frame;
-	boost::python::list descriptors;
-	Size frameSizeAfterInterpolation = 
-		opts.Interpolation
-			? Size(2*rdr.DownsampledFrameSize.width - 1, 2*rdr.DownsampledFrameSize.height - 1)
-			: rdr.DownsampledFrameSize;
-	int cellSize = rdr.OriginalFrameSize.width / frameSizeAfterInterpolation.width;
-	double fscale = 1 / 8.0;
-	HofMbhBuffer buffer(hogInfo, hofInfo, mbhInfo, nt_cell, tStride, frameSizeAfterInterpolation, fscale, rdr.frameCount, true);
-
-	// we read and discard until we get to the start frame
-	while(time < start){
-		frame = rdr.Read();
-		if (frame.PTS == -1){
-//			descriptors.append(-3.);
-			break;
+	ExtractionStats stats;
+	PythonResult result(opts);
+	if(fromMotionField)
+		ExtractDescriptorsFromMotionField(opts, start, end, *result.sink, stats);
+	else
+		ExtractDescriptors(opts, start, end, *result.sink, stats, NULL, session);
+
+	QuantizationError error;
+	list descriptors = result.Finish(opts, error);
+	stats.QuantizationMeanAbsError = error.MeanAbs();
+	stats.QuantizationMaxAbsError = error.maxAbs;
+	lastStats = stats;
+	return descriptors;
+}
+
+// One result per range, in the order given, all from a single decode of the video
+list RunRanges(Options& opts, list ranges)
+{
+	vector<pair<double, double> > bounds;
+	vector<unique_ptr<PythonResult> > results;
+	vector<DescriptorSink*> sinks;
+	for(int i = 0; i < len(ranges); i++)
+	{
+		bounds.push_back(make_pair(extract<double>(ranges[i][0])(), extract<double>(ranges[i][1])()));
+		results.push_back(unique_ptr<PythonResult>(new PythonResult(opts)));
+		sinks.push_back(results.back()->sink.get());
+	}
+
+	ExtractionStats stats;
+	ExtractDescriptorRanges(opts, bounds, sinks, stats);
+
+	QuantizationError error;
+	list res;
+	for(int i = 0; i < results.size(); i++)
+		res.append(results[i]->Finish(opts, error));
+	stats.QuantizationMeanAbsError = error.MeanAbs();
+	stats.QuantizationMaxAbsError = error.maxAbs;
+	lastStats = stats;
+	return res;
+}
+
+// start may also be a list of (start, end) ranges, then end is ignored and the result holds one entry per range
+list get_descriptors(string video, object start = object(0.0), double end =-1, dict options = dict())
+{
+	Options opts = ParseOptions(video, options);
+	extract<list> ranges(start);
+	if(ranges.check())
+		return RunRanges(opts, ranges());
+	return RunExtraction(opts, extract<double>(start), end, false);
+}
+
+list get_descriptors_from_motion_field(string path, double start =0, double end =-1, dict options = dict())
+{
+	Options opts = ParseOptions(path, options);
+	return RunExtraction(opts, start, end, true);
+}
+
+// Keeps float descriptors in C++ until the window is handed to Python, so extraction can run without the GIL
+struct FloatVectorSink : DescriptorSink
+{
+	vector<float> data;
+
+	void Append(const float* descriptor, int dim)
+	{
+		data.insert(data.end(), descriptor, descriptor + dim);
+	}
+};
+
+// Hands the descriptors of each live window to a Python callable as callback(descriptors, info) and starts a new batch.
+// Extraction runs without the GIL, OnWindow takes it for as long as it deals with Python objects.
+struct PythonWindowCallback : WindowListener
+{
+	object callback;
+	FloatVectorSink* floats;
+	QuantizedDescriptorSink* quantized;
+
+	PythonWindowCallback(object callback, FloatVectorSink* floats, QuantizedDescriptorSink* quantized)
+		: callback(callback), floats(floats), quantized(quantized)
+	{
+	}
+
+	void OnWindow(float time, double latencyMs, double lagSeconds)
+	{
+		PyGILState_STATE gil = PyGILState_Ensure();
+		try
+		{
+			Deliver(time, latencyMs, lagSeconds);
 		}
-		time = rdr.time;
-	}	
-	while(true){
-		frame = rdr.Read();
-		if (frame.PTS == -1) {
-//		    	descriptors.append(-1.);
-			break;
+		catch(...)
+		{
+			PyGILState_Release(gil);
+			throw;
 		}
-		else if (rdr.time > end){
-			//rdr.release();
-//			descriptors.append(-2.);
-			break;
+		PyGILState_Release(gil);
+	}
+
+	void Deliver(float time, double latencyMs, double lagSeconds)
+	{
+		object batch;
+		if(quantized)
+		{
+			const char* data = quantized->data.empty() ? "" : (const char*)&quantized->data[0];
+			batch = object(handle<>(PyBytes_FromStringAndSize(data, quantized->data.size())));
+			quantized->data.clear();
 		}
-		if(frame.NoMotionVectors || (hogInfo.enabled && frame.RawImage.empty())){
-			continue;
+		else
+		{
+			list descriptors;
+			for(int i = 0; i < floats->data.size(); i++)
+				descriptors.append(floats->data[i]);
+			batch = descriptors;
+			floats->data.clear();
 		}
 
-		frame.Interpolate(frameSizeAfterInterpolation, fscale);
-		buffer.Update(frame, rdr.time, 1);
-		if(buffer.AreDescriptorsReady)
+		dict info;
+		info["time"] = time;
+		info["latency_ms"] = latencyMs;
+		info["lag"] = lagSeconds;
+		callback(batch, info);
+	}
+};
+
+// Blocks until the live source ends; descriptors go to callback window by window instead of being returned. Other Python threads,
+// one that stops the stream included, run meanwhile.
+void run_live(string url, object callback, dict options = dict())
+{
+	Options opts = ParseOptions(url, options, true);
+	ExtractionStats stats;
+	FloatVectorSink floatSink;
+	QuantizedDescriptorSink quantizedSink(opts.Output, opts.RootNormalize, ExtractionLayout::ChannelDims(opts), opts.MeasureQuantizationError);
+	bool quantized = opts.IsQuantizedOutput();
+	PythonWindowCallback listener(callback, &floatSink, quantized ? &quantizedSink : NULL);
+	PyThreadState* pythonThread = PyEval_SaveThread();
+	try
+	{
+		ExtractLiveDescriptors(opts, quantized ? (DescriptorSink&)quantizedSink : (DescriptorSink&)floatSink, listener, stats);
+	}
+	catch(...)
+	{
+		PyEval_RestoreThread(pythonThread);
+		throw;
+	}
+	PyEval_RestoreThread(pythonThread);
+	lastStats = stats;
+}
+
+// mpegflow.Session: same as run, but decoders and buffers are kept between calls, which pays off on many short clips
+struct PythonSession
+{
+	ExtractionSession session;
+
+	list Run(string video, double start, double end, dict options)
+	{
+		Options opts = ParseOptions(video, options);
+		return RunExtraction(opts, start, end, false, &session);
+	}
+
+	dict Stats()
+	{
+		dict stats;
+		stats["clips"] = session.Clips;
+		stats["fast_opens"] = session.FastOpens;
+		stats["decoders_opened"] = session.Decoders.Opened;
+		stats["decoders_reused"] = session.Decoders.Reused;
+		stats["seconds"] = session.Seconds;
+		stats["clips_per_second"] = session.Seconds > 0 ? session.Clips / session.Seconds : 0.0;
+		return stats;
+	}
+};
+
+// Same as run, but rows go into the shared memory ring name (see shm_ring.h) as they are emitted, for consumers in other processes;
+// returns the number of rows written. The ring is closed at the end, also when extraction fails or when no consumer frees a slot
+// for timeout seconds. Other Python threads run meanwhile.
+long run_to_ring(string video, string name, double start =0, double end =-1, dict options = dict(), int slots = 4096, double timeout = 30)
+{
+	Options opts = ParseOptions(video, options);
+	if(opts.IsQuantizedOutput())
+		throw runtime_error("The shared memory ring only carries float32 descriptors");
+	ExtractionStats stats;
+	SharedMemoryRingSink sink(name, slots, timeout);
+	PyThreadState* pythonThread = PyEval_SaveThread();
+	try
+	{
+		ExtractDescriptors(opts, start, end, sink, stats);
+	}
+	catch(...)
+	{
+		sink.Close();
+		PyEval_RestoreThread(pythonThread);
+		throw;
+	}
+	sink.Close();
+	PyEval_RestoreThread(pythonThread);
+	lastStats = stats;
+	return sink.writePos;
+}
+
+// Exports memory through the buffer protocol while holding on to whatever owns it (a ring mapping, a vector), so the memoryviews
+// built on top of it never point into freed or unmapped memory
+struct OwnedBufferObject
+{
+	PyObject_HEAD
+	shared_ptr<void>* owner;
+	char* data;
+	Py_ssize_t size;
+};
+
+int OwnedBufferGetBuffer(PyObject* self, Py_buffer* view, int flags)
+{
+	OwnedBufferObject* buffer = (OwnedBufferObject*)self;
+	return PyBuffer_FillInfo(view, self, buffer->data, buffer->size, 0, flags);
+}
+
+void OwnedBufferDealloc(PyObject* self)
+{
+	delete ((OwnedBufferObject*)self)->owner;
+	Py_TYPE(self)->tp_free(self);
+}
+
+PyBufferProcs ownedBufferProcs;
+PyTypeObject ownedBufferType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+void RegisterOwnedBufferType()
+{
+	ownedBufferProcs.bf_getbuffer = OwnedBufferGetBuffer;
+	ownedBufferType.tp_name = "mpegflow.OwnedBuffer";
+	ownedBufferType.tp_basicsize = sizeof(OwnedBufferObject);
+	ownedBufferType.tp_dealloc = OwnedBufferDealloc;
+	ownedBufferType.tp_as_buffer = &ownedBufferProcs;
+#if PY_MAJOR_VERSION >= 3
+	ownedBufferType.tp_flags = Py_TPFLAGS_DEFAULT;
+#else
+	ownedBufferType.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_NEWBUFFER;
+#endif
+	if(PyType_Ready(&ownedBufferType) < 0)
+		throw_error_already_set();
+}
+
+// A writable memoryview of size bytes at data, which owner keeps alive
+object OwnedMemoryView(shared_ptr<void> owner, char* data, Py_ssize_t size)
+{
+	static char empty;
+	OwnedBufferObject* buffer = PyObject_New(OwnedBufferObject, &ownedBufferType);
+	if(!buffer)
+		throw_error_already_set();
+	buffer->owner = new shared_ptr<void>(owner);
+	buffer->data = size > 0 ? data : &empty;
+	buffer->size = size;
+	PyObject* view = PyMemoryView_FromObject((PyObject*)buffer);
+	Py_DECREF(buffer);
+	if(!view)
+		throw_error_already_set();
+	return object(handle<>(view));
+}
+
+// Hands values over to a memoryview, without copying them like AsBytes does; values is left empty
+template<typename T>
+object AsMemoryView(vector<T>& values)
+{
+	shared_ptr<vector<T> > owner = make_shared<vector<T> >();
+	owner->swap(values);
+	return OwnedMemoryView(owner, owner->empty() ? NULL : (char*)&(*owner)[0], owner->size() * sizeof(T));
+}
+
+// mpegflow.RingReader: consumer of a ring filled by run_to_ring in another process. read() claims up to max_rows rows and returns their
+// slots as a memoryview over the shared memory, without copies, or None once the ring is finished (empty when nothing came in time). View it with
+//   numpy.frombuffer(view, numpy.dtype({'names': ['window', 'time', 'scale', 'row'], 'formats': ['u8', 'f4', 'i4', ('f4', reader.dim())],
+//     'offsets': [8, 16, 20, 32], 'itemsize': reader.slot_size()}))
+// Rows stay valid until the next read or release; the memory stays mapped as long as a view of it is alive.
+struct PythonRingReader
+{
+	SharedMemoryRingReader reader;
+	RingWindow held;
+
+	PythonRingReader(string name, double timeout) : reader(name, timeout)
+	{
+	}
+
+	object Read(int maxRows, double timeout)
+	{
+		Release();
+		Py_BEGIN_ALLOW_THREADS
+		held = reader.Claim(maxRows, timeout);
+		Py_END_ALLOW_THREADS
+		if(held.count == 0 && reader.Finished())
+			return object();
+		return OwnedMemoryView(reader.mapped, (char*)held.slots, Py_ssize_t(held.count) * reader.SlotSize());
+	}
+
+	void Release()
+	{
+		if(held.count > 0)
+			reader.Release(held);
+	}
+
+	bool Finished()
+	{
+		return reader.Finished();
+	}
+
+	int Dim()
+	{
+		return reader.Dim();
+	}
+
+	int SlotSize()
+	{
+		return reader.SlotSize();
+	}
+
+	void Unlink()
+	{
+		reader.Unlink();
+	}
+
+	~PythonRingReader()
+	{
+		Release();
+	}
+};
+
+template<typename T>
+object AsBytes(vector<T>& values)
+{
+	const char* data = values.empty() ? "" : (const char*)&values[0];
+	return object(handle<>(PyBytes_FromStringAndSize(data, values.size() * sizeof(T))));
+}
+
+// Without a path, flow holds int16 (frames, height, width, 2) and missing uint8 (frames, height, width), both as memoryviews over the
+// arrays the frames were converted into, for numpy.frombuffer. With a path the frames only go to the file, a frame at a time, and
+// just their count and grid size come back; run_motion_field reads the file back.
+dict export_motion_field(string video, string path = "", double start =0, double end =-1, dict options = dict())
+{
+	Options opts = ParseOptions(video, options);
+	MotionFieldArray array;
+	ExtractionStats stats;
+	Size gridSize = ExportMotionField(opts, start, end, path, path.empty() ? &array : NULL, stats);
+	lastStats = stats;
+
+	dict res;
+	res["height"] = gridSize.height;
+	res["width"] = gridSize.width;
+	if(!path.empty())
+	{
+		int frames = 0;
+		for(map<char, int>::iterator it = stats.SampledFrames.begin(); it != stats.SampledFrames.end(); ++it)
+			frames += it->second;
+		res["path"] = path;
+		res["frames"] = frames;
+		return res;
+	}
+
+	res["frames"] = array.frames;
+	res["flow"] = AsMemoryView(array.flow);
+	res["missing"] = AsMemoryView(array.missing);
+	res["pict_types"] = array.pictTypes;
+
+	list pts, times, frameSpans;
+	for(int i = 0; i < array.frames; i++)
+	{
+		pts.append(array.pts[i]);
+		times.append(array.times[i]);
+		frameSpans.append(array.frameSpans[i]);
+	}
+	res["pts"] = pts;
+	res["time"] = times;
+	res["frame_span"] = frameSpans;
+	return res;
+}
+
+// Dense descriptors (stride 1) of every window as one (windows, rows, cols, descriptor_dim) tensor per patch size; data is float32 bytes,
+// or quantized like run's output when the options ask for it
+list get_dense_descriptors(string video, double start =0, double end =-1, dict options = dict())
+{
+	Options opts = ParseOptions(video, options);
+	opts.Dense = true;
+	vector<DenseDescriptorTensor> tensors;
+	list unusedList;
+	PythonListSink unused(unusedList);
+	ExtractionStats stats;
+	ExtractDescriptors(opts, start, end, unused, stats, &tensors);
+
+	list res;
+	for(int k = 0; k < tensors.size(); k++)
+	{
+		DenseDescriptorTensor& tensor = tensors[k];
+		dict t;
+		t["patch_width"] = tensor.patchSize.width;
+		t["patch_height"] = tensor.patchSize.height;
+		t["shape"] = boost::python::make_tuple(tensor.windows, tensor.rows, tensor.cols, tensor.dim);
+		if(opts.IsQuantizedOutput())
 		{
-			for(int k = 0; k < patchSizes.size(); k++)
-			{
-				int blockWidth = patchSizes[k].width / cellSize;
-				int blockHeight = patchSizes[k].height / cellSize;
-				int xStride = opts.Dense ? 1 : blockWidth / 2;
-				int yStride = opts.Dense ? 1 : blockHeight / 2;
-				buffer.PrintFullDescriptor(blockWidth, blockHeight, xStride, yStride, descriptors);
-			}
+			vector<unsigned char> quantized;
+			if(!tensor.data.empty())
+				Quantize(&tensor.data[0], tensor.data.size(), opts.Output, opts.RootNormalize ? ExtractionLayout::ChannelDims(opts) : vector<int>(), quantized);
+			t["data"] = AsBytes(quantized);
 		}
+		else
+			t["data"] = AsBytes(tensor.data);
+		res.append(t);
 	}
-	return descriptors;
- }
+	lastStats = stats;
+	return res;
+}
+
+dict get_stats()
+{
+	dict stats;
+	stats["emitted_patches"] = lastStats.EmittedPatches;
+	stats["pruned_patches"] = lastStats.PrunedPatches;
+	stats["skipped_frames"] = lastStats.SkippedFrames;
+	stats["descriptor_dim"] = lastStats.DescriptorDim;
+	stats["cpu_level"] = lastStats.CpuLevel;
+	stats["quantization_mean_abs_error"] = lastStats.QuantizationMeanAbsError;
+	stats["quantization_max_abs_error"] = lastStats.QuantizationMaxAbsError;
+	stats["windows"] = lastStats.LatencyWindows;
+	stats["mean_latency_ms"] = lastStats.MeanLatencyMs();
+	stats["max_latency_ms"] = lastStats.MaxLatencyMs;
+	stats["lag"] = lastStats.LagSeconds;
+	stats["max_lag"] = lastStats.MaxLagSeconds;
+	stats["bytes_read"] = lastStats.BytesRead;
+	stats["io_ms"] = lastStats.IoMs;
+	stats["read_stall_ms"] = lastStats.ReadStallMs;
+
+	dict sampledFrames;
+	for(map<char, int>::iterator it = lastStats.SampledFrames.begin(); it != lastStats.SampledFrames.end(); ++it)
+		sampledFrames[string(1, it->first)] = it->second;
+	stats["sampled_frames"] = sampledFrames;
+	return stats;
+}
+
+// Values of a quantized result as floats; with root_normalized they are squared, which gives every channel back L1-normalized
+list dequantize(object data, string dtype, bool rootNormalized = false)
+{
+	OutputMode mode = Options::ParseOutputMode(dtype);
+	const unsigned char* src = (const unsigned char*)PyBytes_AsString(data.ptr());
+	if(!src)
+		throw_error_already_set();
+	int n = PyBytes_Size(data.ptr()) / OutputElementSize(mode);
+
+	vector<float> values(n);
+	if(n > 0)
+		Dequantize(src, n, mode, rootNormalized, &values[0]);
+
+	list res;
+	for(int i = 0; i < n; i++)
+		res.append(values[i]);
+	return res;
+}
+
+// samples holds float32 descriptors as bytes (e.g. numpy tobytes() of run's output), channel_dims their per-channel split;
+// the fitted projection is saved to path for the "projection" option
+void fit_projection(object samples, list channelDims, list outputDims, string path)
+{
+	const char* data = PyBytes_AsString(samples.ptr());
+	if(!data)
+		throw_error_already_set();
+
+	vector<int> channels, outputs;
+	int dim = 0;
+	for(int c = 0; c < len(channelDims); c++)
+	{
+		channels.push_back(extract<int>(channelDims[c]));
+		dim += channels.back();
+	}
+	for(int c = 0; c < len(outputDims); c++)
+		outputs.push_back(extract<int>(outputDims[c]));
+
+	int rows = dim > 0 ? PyBytes_Size(samples.ptr()) / (dim * sizeof(float)) : 0;
+	DescriptorProjection::Fit((const float*)data, rows, channels, outputs).Save(path);
+}
+
+string get_cpu_level()
+{
+	return ActiveKernels()->Name;
+}
+
+// true when lookup-table orientation binning matches the exact kernels bit for bit, for the HOF and MBH/HOG binnings,
+// the latter also on the flow of a 16:9 and of a 4:3 frame divided by its aspect, as MBH-X bins it
+bool check_orientation_table()
+{
+	DescInfo hofInfo(8+1, true, 3, true), mbhInfo(8, false, 3, true);
+	return CheckOrientationTable(hofInfo) && CheckOrientationTable(mbhInfo)
+		&& CheckOrientationTable(mbhInfo, 1080.0f/1920.0f) && CheckOrientationTable(mbhInfo, 480.0f/640.0f);
+}
 
 float get_video_length(string video)
 {
@@ -119,7 +612,30 @@ float get_video_length(string video)
 
 
 BOOST_PYTHON_MODULE(mpegflow) {
-    def("run", get_descriptors);
+    RegisterOwnedBufferType();
+    def("run", get_descriptors, (boost::python::arg("video"), boost::python::arg("start") = 0.0, boost::python::arg("end") = -1.0, boost::python::arg("options") = dict()));
+    def("run_motion_field", get_descriptors_from_motion_field, (boost::python::arg("path"), boost::python::arg("start") = 0.0, boost::python::arg("end") = -1.0, boost::python::arg("options") = dict()));
+    def("run_dense", get_dense_descriptors, (boost::python::arg("video"), boost::python::arg("start") = 0.0, boost::python::arg("end") = -1.0, boost::python::arg("options") = dict()));
+    def("run_live", run_live, (boost::python::arg("url"), boost::python::arg("callback"), boost::python::arg("options") = dict()));
+    def("export_motion_field", export_motion_field, (boost::python::arg("video"), boost::python::arg("path") = "", boost::python::arg("start") = 0.0, boost::python::arg("end") = -1.0, boost::python::arg("options") = dict()));
+    def("get_stats", get_stats);
+    class_<PythonSession, boost::noncopyable>("Session")
+        .def("run", &PythonSession::Run, (boost::python::arg("video"), boost::python::arg("start") = 0.0, boost::python::arg("end") = -1.0, boost::python::arg("options") = dict()))
+        .def("stats", &PythonSession::Stats);
+    def("run_to_ring", run_to_ring, (boost::python::arg("video"), boost::python::arg("name"), boost::python::arg("start") = 0.0, boost::python::arg("end") = -1.0, boost::python::arg("options") = dict(), boost::python::arg("slots") = 4096, boost::python::arg("timeout") = 30.0));
+    class_<PythonRingReader, boost::noncopyable>("RingReader", init<string, double>((boost::python::arg("name"), boost::python::arg("timeout") = 10.0)))
+        .def("read", &PythonRingReader::Read, (boost::python::arg("max_rows") = 256, boost::python::arg("timeout") = 1.0))
+        .def("release", &PythonRingReader::Release)
+        .def("finished", &PythonRingReader::Finished)
+        .def("dim", &PythonRingReader::Dim)
+        .def("slot_size", &PythonRingReader::SlotSize)
+        .def("unlink", &PythonRingReader::Unlink);
+    def("dequantize", dequantize, (boost::python::arg("data"), boost::python::arg("dtype"), boost::python::arg("root_normalized") = false));
+    def("fit_projection", fit_projection, (boost::python::arg("samples"), boost::python::arg("channel_dims"), boost::python::arg("output_dims"), boost::python::arg("path")));
+    def("set_cpu_level", SetCpuLevel);
+    def("get_cpu_level", get_cpu_level);
+    def("set_orientation_table", SetOrientationTableMode);
+    def("check_orientation_table", check_orientation_table);
     def("get_video_length", get_video_length);
     def("open_file", open_file);
 }
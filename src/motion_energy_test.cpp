@@ -0,0 +1,95 @@
+// Motion energy test: checks MotionEnergyBuffer::QueryPatchEnergy against the mean flow magnitude summed pixel by pixel over
+// the cells ComputeDescriptor covers, for patch sizes that are and aren't multiples of the cell count, and that motion in the
+// columns and rows of a patch no descriptor cell reaches doesn't count. The integral volume used with temporal scales has to agree
+// with the per-cell stacks. Exits with 1 on the first mismatch.
+//
+// Usage: motion_energy_test
+
+#include <cstdio>
+#include <cmath>
+
+#include "descriptors.h"
+
+using namespace std;
+
+// Mean magnitude over the pixels the nxCells x nyCells cells of rect sum, x..x+nxCells*(width/nxCells) inclusive as in ComputeDescriptor
+float ReferenceEnergy(const vector<pair<Mat_<float>, Mat_<float> > >& frames, Rect rect, int nxCells, int nyCells)
+{
+	int right = std::min(rect.x + nxCells*(rect.width/nxCells), frames[0].first.cols - 1);
+	int bottom = std::min(rect.y + nyCells*(rect.height/nyCells), frames[0].first.rows - 1);
+	double sum = 0;
+	for(int f = 0; f < frames.size(); f++)
+		for(int i = rect.y; i <= bottom; i++)
+			for(int j = rect.x; j <= right; j++)
+				sum += sqrt(frames[f].first(i, j)*frames[f].first(i, j) + frames[f].second(i, j)*frames[f].second(i, j));
+	return float(sum / ((right - rect.x + 1) * (bottom - rect.y + 1) * frames.size()));
+}
+
+int main()
+{
+	const int ntCells = 3;
+	Size sz(64, 48);
+	int sizes[] = { 32, 30, 31, 47 };
+	int cellCounts[] = { 2, 3 };
+
+	RNG rng(0x1357);
+	MotionEnergyBuffer motionEnergy(ntCells, 1), volumeEnergy(ntCells, 1);
+	volumeEnergy.EnableVolume(ntCells + 1);
+	vector<pair<Mat_<float>, Mat_<float> > > frames;
+	for(int t = 0; t < ntCells; t++)
+	{
+		Mat_<float> dx(sz), dy(sz);
+		for(int i = 0; i < sz.height; i++)
+			for(int j = 0; j < sz.width; j++)
+			{
+				dx(i, j) = rng.uniform(-8.f, 8.f);
+				dy(i, j) = rng.uniform(-8.f, 8.f);
+			}
+		frames.push_back(make_pair(dx, dy));
+		motionEnergy.Update(dx, dy);
+		motionEnergy.AddUpCurrentStack();
+		volumeEnergy.Update(dx, dy);
+	}
+
+	for(int c = 0; c < 2; c++)
+	for(int s = 0; s < 4; s++)
+	for(int y = 0; y + sizes[s] < sz.height; y += 5)
+	for(int x = 0; x + sizes[s] < sz.width; x += 7)
+	{
+		Rect rect(x, y, sizes[s], sizes[s]);
+		float expected = ReferenceEnergy(frames, rect, cellCounts[c], cellCounts[c]);
+		float actual = motionEnergy.QueryPatchEnergy(rect, cellCounts[c], cellCounts[c]);
+		if(fabs(actual - expected) > 1e-3f * expected)
+		{
+			fprintf(stderr, "%d cells, %dx%d patch at (%d, %d): energy %g, pixel sum gives %g\n", cellCounts[c], sizes[s], sizes[s], x, y, actual, expected);
+			return 1;
+		}
+
+		float window = volumeEnergy.QueryWindowEnergy(rect, cellCounts[c], cellCounts[c], 0, ntCells);
+		if(fabs(window - expected) > 1e-3f * expected)
+		{
+			fprintf(stderr, "%d cells, %dx%d patch at (%d, %d): volume energy %g, pixel sum gives %g\n", cellCounts[c], sizes[s], sizes[s], x, y, window, expected);
+			return 1;
+		}
+	}
+
+	// 32px patches in 3 cells of 10px: all motion in the last column and row, past the 30px the cells cover, none of it may count
+	Mat_<float> dx = Mat_<float>::zeros(sz), dy = Mat_<float>::zeros(sz);
+	Rect rect(4, 4, 32, 32);
+	for(int k = 0; k < 32; k++)
+	{
+		dx(rect.y + k, rect.x + 31) = 5;
+		dy(rect.y + 31, rect.x + k) = 5;
+	}
+	MotionEnergyBuffer edgeOnly(1, 1);
+	edgeOnly.Update(dx, dy);
+	edgeOnly.AddUpCurrentStack();
+	if(edgeOnly.QueryPatchEnergy(rect, 3, 3) != 0)
+	{
+		fprintf(stderr, "motion outside the descriptor cells counted: %g\n", edgeOnly.QueryPatchEnergy(rect, 3, 3));
+		return 1;
+	}
+
+	printf("ok\n");
+	return 0;
+}
@@ -0,0 +1,244 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <algorithm>
+#include <stdint.h>
+#include <zlib.h>
+#include <opencv/cv.h>
+
+#include "common.h"
+
+using namespace cv;
+using namespace std;
+
+#ifndef __MOTION_FIELD_H__
+#define __MOTION_FIELD_H__
+
+// Motion fields are the per-frame motion vector grids built by FrameReader, before interpolation. Keeping them around
+// lets descriptors be recomputed with other parameters without decoding the video again.
+//
+// On-disk layout (native endianness):
+//   header:    "MVF1" | int32 gridWidth | int32 gridHeight | int32 width | int32 height | int32 frameCount | float fps
+//   per frame: int64 pts | float time | int32 frameIndex | int32 frameSpan | char pictType | uint8 noMotionVectors | uint32 compressedSize | zlib payload
+//   payload:   int16 dx[gridHeight*gridWidth] | int16 dy[gridHeight*gridWidth] | uint8 missing[gridHeight*gridWidth]
+// Motion vectors are whole pixels, so int16 holds them exactly.
+
+struct MotionFieldHeader
+{
+	int32_t gridWidth, gridHeight;
+	int32_t width, height;
+	int32_t frameCount;
+	float fps;
+};
+
+inline int16_t ToMotionValue(float v)
+{
+	return int16_t(std::max(-32768.0f, std::min(32767.0f, v)));
+}
+
+struct MotionFieldWriter
+{
+	FILE* file;
+	MotionFieldHeader header;
+	vector<unsigned char> payload;
+	vector<unsigned char> compressed;
+
+	MotionFieldWriter(const char* path, MotionFieldHeader header) : header(header)
+	{
+		file = fopen(path, "wb");
+		if(!file)
+			throw runtime_error(string("Could not open motion field file for writing: ") + path);
+
+		fwrite("MVF1", 1, 4, file);
+		fwrite(&header.gridWidth, sizeof(int32_t), 1, file);
+		fwrite(&header.gridHeight, sizeof(int32_t), 1, file);
+		fwrite(&header.width, sizeof(int32_t), 1, file);
+		fwrite(&header.height, sizeof(int32_t), 1, file);
+		fwrite(&header.frameCount, sizeof(int32_t), 1, file);
+		fwrite(&header.fps, sizeof(float), 1, file);
+	}
+
+	void Write(Frame& f, float time)
+	{
+		int area = header.gridWidth * header.gridHeight;
+		payload.resize(area * (2*sizeof(int16_t) + 1));
+		int16_t* dx = (int16_t*)&payload[0];
+		int16_t* dy = dx + area;
+		uint8_t* missing = (uint8_t*)(dy + area);
+		for(int i = 0; i < area; i++)
+		{
+			dx[i] = f.NoMotionVectors ? 0 : ToMotionValue(f.Dx.ptr<float>()[i]);
+			dy[i] = f.NoMotionVectors ? 0 : ToMotionValue(f.Dy.ptr<float>()[i]);
+			missing[i] = f.NoMotionVectors ? 0 : f.Missing.ptr<bool>()[i];
+		}
+
+		uLongf compressedSize = compressBound(payload.size());
+		compressed.resize(compressedSize);
+		if(compress2(&compressed[0], &compressedSize, &payload[0], payload.size(), Z_BEST_SPEED) != Z_OK)
+			throw runtime_error("Could not compress motion field");
+
+		int64_t pts = f.PTS;
+		int32_t frameIndex = f.FrameIndex, frameSpan = f.FrameSpan;
+		uint8_t noMotionVectors = f.NoMotionVectors;
+		uint32_t size = compressedSize;
+		fwrite(&pts, sizeof(pts), 1, file);
+		fwrite(&time, sizeof(time), 1, file);
+		fwrite(&frameIndex, sizeof(frameIndex), 1, file);
+		fwrite(&frameSpan, sizeof(frameSpan), 1, file);
+		fwrite(&f.PictType, 1, 1, file);
+		fwrite(&noMotionVectors, 1, 1, file);
+		fwrite(&size, sizeof(size), 1, file);
+		if(fwrite(&compressed[0], 1, size, file) != size)
+			throw runtime_error("Could not write motion field");
+	}
+
+	~MotionFieldWriter()
+	{
+		fclose(file);
+	}
+};
+
+// Plays a motion field file back with the same interface as FrameReader, so the descriptor pipeline runs on either
+struct MotionFieldReader
+{
+	FILE* file;
+	MotionFieldHeader header;
+	Size DownsampledFrameSize;
+	Size OriginalFrameSize;
+	int frameCount;
+	float fps;
+	float time;
+	vector<unsigned char> payload;
+	vector<unsigned char> compressed;
+
+	MotionFieldReader(const char* path) : time(-1.)
+	{
+		file = fopen(path, "rb");
+		char magic[4];
+		if(!file || fread(magic, 1, 4, file) != 4 || string(magic, 4) != "MVF1")
+		{
+			if(file)
+				fclose(file);
+			throw runtime_error(string("Not a motion field file: ") + path);
+		}
+
+		bool ok = fread(&header.gridWidth, sizeof(int32_t), 1, file) == 1
+			&& fread(&header.gridHeight, sizeof(int32_t), 1, file) == 1
+			&& fread(&header.width, sizeof(int32_t), 1, file) == 1
+			&& fread(&header.height, sizeof(int32_t), 1, file) == 1
+			&& fread(&header.frameCount, sizeof(int32_t), 1, file) == 1
+			&& fread(&header.fps, sizeof(float), 1, file) == 1;
+		if(!ok)
+		{
+			fclose(file);
+			throw runtime_error(string("Truncated motion field header: ") + path);
+		}
+
+		DownsampledFrameSize = Size(header.gridWidth, header.gridHeight);
+		OriginalFrameSize = Size(header.width, header.height);
+		frameCount = header.frameCount;
+		fps = header.fps;
+	}
+
+	// PTS is -1 once the file is exhausted, like FrameReader::Read
+	Frame Read()
+	{
+		int64_t pts;
+		float frameTime;
+		int32_t frameIndex, frameSpan;
+		char pictType;
+		uint8_t noMotionVectors;
+		uint32_t size;
+		bool ok = fread(&pts, sizeof(pts), 1, file) == 1
+			&& fread(&frameTime, sizeof(frameTime), 1, file) == 1
+			&& fread(&frameIndex, sizeof(frameIndex), 1, file) == 1
+			&& fread(&frameSpan, sizeof(frameSpan), 1, file) == 1
+			&& fread(&pictType, 1, 1, file) == 1
+			&& fread(&noMotionVectors, 1, 1, file) == 1
+			&& fread(&size, sizeof(size), 1, file) == 1;
+		if(ok)
+		{
+			compressed.resize(size);
+			ok = size > 0 && fread(&compressed[0], 1, size, file) == size;
+		}
+
+		int area = DownsampledFrameSize.area();
+		payload.resize(area * (2*sizeof(int16_t) + 1));
+		uLongf payloadSize = payload.size();
+		if(!ok || uncompress(&payload[0], &payloadSize, &compressed[0], size) != Z_OK || payloadSize != payload.size())
+		{
+			Frame end;
+			end.PTS = -1;
+			return end;
+		}
+
+		Frame f(frameIndex, Mat_<float>(DownsampledFrameSize), Mat_<float>(DownsampledFrameSize), Mat_<bool>(DownsampledFrameSize));
+		const int16_t* dx = (const int16_t*)&payload[0];
+		const int16_t* dy = dx + area;
+		const uint8_t* missing = (const uint8_t*)(dy + area);
+		float* ptr_dx = f.Dx.ptr<float>();
+		float* ptr_dy = f.Dy.ptr<float>();
+		bool* ptr_missing = f.Missing.ptr<bool>();
+		f.MotionCells = 0;
+		for(int i = 0; i < area; i++)
+		{
+			ptr_dx[i] = dx[i];
+			ptr_dy[i] = dy[i];
+			ptr_missing[i] = missing[i];
+			f.MotionCells += dx[i] != 0 || dy[i] != 0;
+		}
+
+		f.PTS = pts;
+		f.PictType = pictType;
+		f.FrameSpan = frameSpan;
+		f.NoMotionVectors = noMotionVectors;
+		f.width = OriginalFrameSize.width;
+		f.height = OriginalFrameSize.height;
+		time = frameTime;
+		return f;
+	}
+
+	~MotionFieldReader()
+	{
+		fclose(file);
+	}
+};
+
+// In-memory motion field laid out as a (T, H, W, 2) int16 flow array plus a (T, H, W) missing mask, ready to be wrapped by numpy
+struct MotionFieldArray
+{
+	vector<int16_t> flow;
+	vector<uint8_t> missing;
+	vector<int64_t> pts;
+	vector<float> times;
+	vector<int> frameSpans;
+	string pictTypes;
+	Size gridSize;
+	int frames;
+
+	MotionFieldArray() : frames(0) {}
+
+	void Append(Frame& f, float time, Size gridSize)
+	{
+		this->gridSize = gridSize;
+		int area = gridSize.area();
+		size_t offset = missing.size();
+		flow.resize(flow.size() + 2*area);
+		missing.resize(missing.size() + area);
+		for(int i = 0; i < area; i++)
+		{
+			flow[2*(offset + i)] = f.NoMotionVectors ? 0 : ToMotionValue(f.Dx.ptr<float>()[i]);
+			flow[2*(offset + i) + 1] = f.NoMotionVectors ? 0 : ToMotionValue(f.Dy.ptr<float>()[i]);
+			missing[offset + i] = f.NoMotionVectors ? 0 : f.Missing.ptr<bool>()[i];
+		}
+
+		pts.push_back(f.PTS);
+		times.push_back(time);
+		frameSpans.push_back(f.FrameSpan);
+		pictTypes += f.PictType;
+		frames++;
+	}
+};
+
+#endif
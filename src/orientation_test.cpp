@@ -0,0 +1,109 @@
+// Orientation binning test: checks every kernel level the cpu supports against cv::fastAtan2 and sqrt on random grid and
+// off-grid motion, and the orientation tables against the kernels bit for bit, for the HOF and MBH binnings and for MBH-X
+// flow divided by the aspect of common frame sizes. Exits with 1 on the first mismatch.
+//
+// Usage: orientation_test [samples]
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "descriptors.h"
+
+using namespace std;
+
+// Histogram of one (dx, dy) as the kernels should bin it: the angle from cv::fastAtan2 split between its two nearest bins
+void ReferenceHistogram(float dx, float dy, OrientationBinningParams& params, vector<float>& hist)
+{
+	hist.assign(params.nBins, 0);
+	float m = sqrt(dx*dx + dy*dy);
+	if(params.applyThresholding && m <= params.threshold)
+	{
+		hist[params.angleBins] = 1;
+		return;
+	}
+
+	float orientation = fastAtan2(dy, dx);
+	if(orientation > params.fullAngle)
+		orientation -= params.fullAngle;
+	float fbin = orientation * params.invAngleBase;
+	int bin0 = int(floor(fbin));
+	int bin1 = (bin0 + 1) % params.angleBins;
+	hist[bin0 % params.angleBins] += (1 - (fbin - bin0))*m;
+	hist[bin1] += (fbin - bin0)*m;
+}
+
+// Angles within rounding of a bin border may go to either side of it, so the histograms are compared rather than the bins
+bool CheckKernel(const KernelTable* kernels, DescInfo descInfo, int samples, RNG& rng)
+{
+	OrientationBinningParams params = BinningParamsFor(descInfo);
+	vector<float> dx(samples), dy(samples), w0(samples), w1(samples);
+	vector<int> bin0(samples), bin1(samples);
+	for(int i = 0; i < samples; i++)
+	{
+		bool grid = rng.uniform(0, 2) == 0;
+		dx[i] = grid ? float(rng.uniform(-OrientationTable::range, OrientationTable::range + 1)) / OrientationTable::scale : rng.uniform(-20.f, 20.f);
+		dy[i] = grid ? float(rng.uniform(-OrientationTable::range, OrientationTable::range + 1)) / OrientationTable::scale : rng.uniform(-20.f, 20.f);
+	}
+	kernels->BinOrientations(&dx[0], &dy[0], samples, params, &bin0[0], &bin1[0], &w0[0], &w1[0]);
+
+	vector<float> expected, actual;
+	for(int i = 0; i < samples; i++)
+	{
+		ReferenceHistogram(dx[i], dy[i], params, expected);
+		actual.assign(params.nBins, 0);
+		actual[bin0[i]] += w0[i];
+		actual[bin1[i]] += w1[i];
+
+		float m = sqrt(dx[i]*dx[i] + dy[i]*dy[i]);
+		for(int b = 0; b < params.nBins; b++)
+		{
+			if(fabs(actual[b] - expected[b]) > 1e-3f*m + 1e-6f)
+			{
+				fprintf(stderr, "%s: (%g, %g) bin %d got %g, fastAtan2 gives %g\n", kernels->Name, dx[i], dy[i], b, actual[b], expected[b]);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	int samples = argc > 1 ? atoi(argv[1]) : 100000;
+	DescInfo hofInfo(8+1, true, 3, true), mbhInfo(8, false, 3, true);
+	DescInfo infos[] = { hofInfo, mbhInfo };
+	float aspects[] = { 1080.0f/1920.0f, 480.0f/640.0f, 576.0f/720.0f, 1920.0f/1080.0f };
+	const char* levels[] = { "generic", "sse4.2", "avx2", "avx512" };
+
+	RNG rng(0x2468);
+	for(int l = 0; l < 4; l++)
+	{
+		if(ParseCpuLevel(levels[l]) > DetectCpuLevel())
+			continue;
+		SetCpuLevel(levels[l]);
+
+		for(int d = 0; d < 2; d++)
+		{
+			if(!CheckKernel(ActiveKernels(), infos[d], samples, rng))
+				return 1;
+			if(!CheckOrientationTable(infos[d]))
+			{
+				fprintf(stderr, "%s: orientation table differs from the kernel\n", levels[l]);
+				return 1;
+			}
+		}
+		for(int a = 0; a < 4; a++)
+		{
+			if(!CheckOrientationTable(mbhInfo, aspects[a]))
+			{
+				fprintf(stderr, "%s: orientation table for aspect %g differs from the kernel\n", levels[l], aspects[a]);
+				return 1;
+			}
+		}
+		printf("%s: ok\n", levels[l]);
+	}
+	return 0;
+}
@@ -0,0 +1,220 @@
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <stdint.h>
+#include <opencv/cv.h>
+
+#include "common.h"
+#include "kernel_registry.h"
+
+using namespace cv;
+using namespace std;
+
+#ifndef __PROJECTION_H__
+#define __PROJECTION_H__
+
+// Per-channel linear projections (PCA) applied to descriptors as they are emitted, so only reduced vectors leave the extractor.
+// A patch descriptor is the concatenation of its channels (hog, hof, mbhx, mbhy, whichever are enabled), each projected on its own.
+//
+// On-disk layout (native endianness):
+//   "PRJ1" | int32 channels
+//   per channel: int32 inputDim | int32 outputDim | float mean[inputDim] | float components[outputDim*inputDim] (row-major, one component per row)
+
+struct ChannelProjection
+{
+	int inputDim, outputDim;
+	vector<float> mean;
+	vector<float> components; // outputDim x inputDim
+	vector<float> weightsT; // components transposed, as ProjectRows wants them
+	vector<float> bias; // -components * mean, so centering folds into the product
+
+	ChannelProjection(int inputDim, int outputDim, const float* mean, const float* components)
+		: inputDim(inputDim), outputDim(outputDim), mean(mean, mean + inputDim), components(components, components + outputDim*inputDim)
+	{
+		weightsT.resize(inputDim*outputDim);
+		bias.assign(outputDim, 0);
+		for(int o = 0; o < outputDim; o++)
+		{
+			double dot = 0;
+			for(int i = 0; i < inputDim; i++)
+			{
+				weightsT[i*outputDim + o] = components[o*inputDim + i];
+				dot += double(components[o*inputDim + i]) * mean[i];
+			}
+			bias[o] = -dot;
+		}
+	}
+};
+
+struct DescriptorProjection
+{
+	vector<ChannelProjection> channels;
+
+	int InputDim()
+	{
+		int dim = 0;
+		for(int c = 0; c < channels.size(); c++)
+			dim += channels[c].inputDim;
+		return dim;
+	}
+
+	int OutputDim()
+	{
+		int dim = 0;
+		for(int c = 0; c < channels.size(); c++)
+			dim += channels[c].outputDim;
+		return dim;
+	}
+
+	// rows descriptors of InputDim() floats each into rows of OutputDim() floats
+	void Apply(const float* descriptors, int rows, float* projected)
+	{
+		int inputDim = InputDim(), outputDim = OutputDim();
+		for(int c = 0, inOffset = 0, outOffset = 0; c < channels.size(); c++)
+		{
+			ChannelProjection& channel = channels[c];
+			ActiveKernels()->ProjectRows(descriptors + inOffset, inputDim, rows, channel.inputDim, &channel.weightsT[0], &channel.bias[0],
+				channel.outputDim, projected + outOffset, outputDim);
+			inOffset += channel.inputDim;
+			outOffset += channel.outputDim;
+		}
+	}
+
+	void Save(string path)
+	{
+		FILE* file = fopen(path.c_str(), "wb");
+		if(!file)
+			throw runtime_error("Could not open projection file for writing: " + path);
+
+		int32_t count = channels.size();
+		bool ok = fwrite("PRJ1", 1, 4, file) == 4 && fwrite(&count, sizeof(count), 1, file) == 1;
+		for(int c = 0; ok && c < channels.size(); c++)
+		{
+			ChannelProjection& channel = channels[c];
+			int32_t dims[] = { channel.inputDim, channel.outputDim };
+			ok = fwrite(dims, sizeof(int32_t), 2, file) == 2
+				&& fwrite(&channel.mean[0], sizeof(float), channel.inputDim, file) == channel.inputDim
+				&& fwrite(&channel.components[0], sizeof(float), channel.components.size(), file) == channel.components.size();
+		}
+		ok = fclose(file) == 0 && ok;
+		if(!ok)
+			throw runtime_error("Could not write projection file: " + path);
+	}
+
+	static DescriptorProjection Load(string path)
+	{
+		FILE* file = fopen(path.c_str(), "rb");
+		char magic[4];
+		int32_t count = 0;
+		if(!file || fread(magic, 1, 4, file) != 4 || string(magic, 4) != "PRJ1" || fread(&count, sizeof(count), 1, file) != 1 || count <= 0)
+		{
+			if(file)
+				fclose(file);
+			throw runtime_error("Not a projection file: " + path);
+		}
+
+		DescriptorProjection projection;
+		for(int c = 0; c < count; c++)
+		{
+			int32_t dims[2];
+			vector<float> mean, components;
+			bool ok = fread(dims, sizeof(int32_t), 2, file) == 2 && dims[0] > 0 && dims[1] > 0 && dims[1] <= dims[0];
+			if(ok)
+			{
+				mean.resize(dims[0]);
+				components.resize(dims[0] * dims[1]);
+				ok = fread(&mean[0], sizeof(float), mean.size(), file) == mean.size()
+					&& fread(&components[0], sizeof(float), components.size(), file) == components.size();
+			}
+			if(!ok)
+			{
+				fclose(file);
+				throw runtime_error("Truncated projection file: " + path);
+			}
+			projection.channels.push_back(ChannelProjection(dims[0], dims[1], &mean[0], &components[0]));
+		}
+		fclose(file);
+		return projection;
+	}
+
+	// PCA of every channel over a sample of full descriptors (rows x sum of channelDims), keeping outputDims[c] components of channel c
+	static DescriptorProjection Fit(const float* samples, int rows, const vector<int>& channelDims, const vector<int>& outputDims)
+	{
+		if(channelDims.empty() || channelDims.size() != outputDims.size())
+			throw runtime_error("Every channel needs an output dimension");
+		int dim = 0;
+		for(int c = 0; c < channelDims.size(); c++)
+			dim += channelDims[c];
+		if(rows < 2)
+			throw runtime_error("Fitting a projection needs at least two sample descriptors");
+
+		DescriptorProjection projection;
+		Mat all(rows, dim, CV_32F, (void*)samples);
+		for(int c = 0, offset = 0; c < channelDims.size(); c++)
+		{
+			if(outputDims[c] < 1 || outputDims[c] > std::min(channelDims[c], rows))
+				throw runtime_error("Output dimension out of range for a channel");
+			Mat channel = all.colRange(offset, offset + channelDims[c]).clone();
+			PCA pca(channel, Mat(), PCA::DATA_AS_ROW, outputDims[c]);
+			Mat_<float> mean = pca.mean, components = pca.eigenvectors;
+			projection.channels.push_back(ChannelProjection(channelDims[c], outputDims[c], mean.ptr<float>(), components.ptr<float>()));
+			offset += channelDims[c];
+		}
+		return projection;
+	}
+};
+
+// Projects descriptors in batches on their way to another sink
+struct ProjectingSink : DescriptorSink
+{
+	static const int batchRows = 256;
+	DescriptorProjection& projection;
+	DescriptorSink& inner;
+	vector<float> batch;
+	vector<float> projected;
+	int rows;
+
+	ProjectingSink(DescriptorProjection& projection, DescriptorSink& inner) : projection(projection), inner(inner), rows(0)
+	{
+		batch.resize(batchRows * projection.InputDim());
+		projected.resize(batchRows * projection.OutputDim());
+	}
+
+	void Append(const float* descriptor, int dim)
+	{
+		int inputDim = projection.InputDim();
+		if(dim != inputDim)
+			throw runtime_error("Projection doesn't match the descriptor dimension");
+		memcpy(&batch[rows * inputDim], descriptor, dim * sizeof(float));
+		if(++rows == batchRows)
+			Flush();
+	}
+
+	void Flush()
+	{
+		if(rows > 0)
+		{
+			int outputDim = projection.OutputDim();
+			projection.Apply(&batch[0], rows, &projected[0]);
+			for(int r = 0; r < rows; r++)
+				inner.Append(&projected[r * outputDim], outputDim);
+			rows = 0;
+		}
+		inner.Flush();
+	}
+
+	void SelectScale(int scale)
+	{
+		Flush();
+		inner.SelectScale(scale);
+	}
+
+	void BeginWindow(float time)
+	{
+		Flush();
+		inner.BeginWindow(time);
+	}
+};
+
+#endif
@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+#include "common.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef __QUANTIZE_H__
+#define __QUANTIZE_H__
+
+// Descriptor values are L2-normalized and lie in [0, 1], which is what both quantizers below rely on. Root normalized ones
+// (RootNormalize) are too.
+enum OutputMode
+{
+	OutputFloat32,
+	OutputFloat16,
+	OutputUint8
+};
+
+int OutputElementSize(OutputMode mode)
+{
+	return mode == OutputFloat32 ? 4 : mode == OutputFloat16 ? 2 : 1;
+}
+
+// Float to half by rebiasing the exponent with a multiplication, so half denormals come out of the FPU for free.
+// Only valid for non-negative inputs that fit in a half, rounds half-up.
+inline uint16_t FloatToHalf(float v)
+{
+	const float rebias = 1.925929944e-34f; // 2^-112
+	float scaled = v * rebias;
+	uint32_t bits;
+	memcpy(&bits, &scaled, sizeof(bits));
+	return uint16_t((bits + 0x1000) >> 13);
+}
+
+inline float HalfToFloat(uint16_t h)
+{
+	const float rebias = 5.192296859e+33f; // 2^112
+	uint32_t bits = uint32_t(h) << 13;
+	float v;
+	memcpy(&v, &bits, sizeof(v));
+	return v * rebias;
+}
+
+void QuantizeFloat16(const float* src, int n, uint16_t* dst)
+{
+	int i = 0;
+#ifdef __SSE2__
+	const __m128 rebias = _mm_set1_ps(1.925929944e-34f);
+	const __m128i roundingBias = _mm_set1_epi32(0x1000);
+	for(; i + 8 <= n; i += 8)
+	{
+		__m128 lo = _mm_loadu_ps(src + i);
+		__m128 hi = _mm_loadu_ps(src + i + 4);
+		__m128i loBits = _mm_srli_epi32(_mm_add_epi32(_mm_castps_si128(_mm_mul_ps(lo, rebias)), roundingBias), 13);
+		__m128i hiBits = _mm_srli_epi32(_mm_add_epi32(_mm_castps_si128(_mm_mul_ps(hi, rebias)), roundingBias), 13);
+		// halves of values in [0, 1] are at most 0x3C00, so the signed saturation never kicks in
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(loBits, hiBits));
+	}
+#endif
+	for(; i < n; i++)
+		dst[i] = FloatToHalf(src[i]);
+}
+
+void QuantizeUint8(const float* src, int n, uint8_t* dst)
+{
+	int i = 0;
+#ifdef __SSE2__
+	const __m128 scale = _mm_set1_ps(255.0f);
+	const __m128 half = _mm_set1_ps(0.5f);
+	for(; i + 16 <= n; i += 16)
+	{
+		__m128 v0 = _mm_loadu_ps(src + i);
+		__m128 v1 = _mm_loadu_ps(src + i + 4);
+		__m128 v2 = _mm_loadu_ps(src + i + 8);
+		__m128 v3 = _mm_loadu_ps(src + i + 12);
+		// rounds half-up like the scalar tail: truncating v*255 + 0.5 is its floor for the non-negative values that survive the clamp
+		__m128i q01 = _mm_packs_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v0, scale), half)), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v1, scale), half)));
+		__m128i q23 = _mm_packs_epi32(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v2, scale), half)), _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v3, scale), half)));
+		_mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(q01, q23));
+	}
+#endif
+	for(; i < n; i++)
+		dst[i] = uint8_t(std::min(255, std::max(0, int(floor(src[i] * 255 + 0.5f)))));
+}
+
+// RootSIFT: every channel L1-normalized, then square-rooted, which leaves it with unit L2 norm. src holds n / rowDim rows, each made
+// of consecutive channels of the given dimensions (hog, hof, mbh-x, mbh-y as far as enabled, see ExtractionLayout::ChannelDims).
+void RootNormalize(const float* src, int n, const std::vector<int>& channels, float* dst)
+{
+	for(int i = 0; i < n;)
+	{
+		for(int c = 0; c < channels.size() && i < n; c++)
+		{
+			int end = std::min(n, i + channels[c]);
+			float sum = 0;
+			for(int j = i; j < end; j++)
+				sum += fabs(src[j]);
+			float scale = sum > 0 ? 1 / sum : 0;
+			for(int j = i; j < end; j++)
+				dst[j] = sqrt(fabs(src[j]) * scale);
+			i = end;
+		}
+	}
+}
+
+// Appends n quantized values to dst
+void Quantize(const float* src, int n, OutputMode mode, std::vector<unsigned char>& dst)
+{
+	size_t offset = dst.size();
+	dst.resize(offset + n * OutputElementSize(mode));
+	unsigned char* out = &dst[offset];
+
+	if(mode == OutputFloat16)
+		QuantizeFloat16(src, n, (uint16_t*)out);
+	else if(mode == OutputUint8)
+		QuantizeUint8(src, n, (uint8_t*)out);
+	else
+		memcpy(out, src, n * sizeof(float));
+}
+
+// Same, root normalizing first when channels isn't empty
+void Quantize(const float* src, int n, OutputMode mode, const std::vector<int>& channels, std::vector<unsigned char>& dst)
+{
+	if(channels.empty())
+	{
+		Quantize(src, n, mode, dst);
+		return;
+	}
+	std::vector<float> rooted(n);
+	RootNormalize(src, n, channels, &rooted[0]);
+	Quantize(&rooted[0], n, mode, dst);
+}
+
+// Inverse of Quantize; with undoRootNormalization the values are squared, which gives every channel back L1-normalized,
+// the original descriptor up to one scale factor per channel
+void Dequantize(const unsigned char* src, int n, OutputMode mode, bool undoRootNormalization, float* dst)
+{
+	for(int i = 0; i < n; i++)
+	{
+		float v;
+		if(mode == OutputFloat16)
+			v = HalfToFloat(((const uint16_t*)src)[i]);
+		else if(mode == OutputUint8)
+			v = src[i] / 255.0f;
+		else
+			v = ((const float*)src)[i];
+		dst[i] = undoRootNormalization ? v*v : v;
+	}
+}
+
+// Reconstruction error of the quantizer, measured against the float values it was given (the root normalized ones when it root normalizes)
+struct QuantizationError
+{
+	double sumAbs;
+	float maxAbs;
+	long long count;
+	std::vector<float> restored; // reused from patch to patch
+
+	QuantizationError() : sumAbs(0), maxAbs(0), count(0) {}
+
+	void Accumulate(const float* original, const unsigned char* quantized, int n, OutputMode mode)
+	{
+		if(restored.size() < size_t(n))
+			restored.resize(n);
+		Dequantize(quantized, n, mode, false, &restored[0]);
+		for(int i = 0; i < n; i++)
+		{
+			float delta = fabs(restored[i] - original[i]);
+			sumAbs += delta;
+			maxAbs = std::max(maxAbs, delta);
+		}
+		count += n;
+	}
+
+	double MeanAbs()
+	{
+		return count > 0 ? sumAbs / count : 0;
+	}
+};
+
+// Collects quantized descriptors into a flat buffer of rows. With root normalization, channels are the dimensions of the
+// channels of a row (ExtractionLayout::ChannelDims).
+struct QuantizedDescriptorSink : DescriptorSink
+{
+	OutputMode mode;
+	bool rootNormalize;
+	std::vector<int> channels;
+	bool measureError;
+	std::vector<unsigned char> data;
+	std::vector<float> rooted; // reused from patch to patch
+	QuantizationError error;
+
+	QuantizedDescriptorSink(OutputMode mode, bool rootNormalize, const std::vector<int>& channels, bool measureError = false)
+		: mode(mode), rootNormalize(rootNormalize), channels(channels), measureError(measureError)
+	{
+	}
+
+	void Append(const float* descriptor, int dim)
+	{
+		if(rootNormalize)
+		{
+			rooted.resize(dim);
+			RootNormalize(descriptor, dim, channels, &rooted[0]);
+			descriptor = &rooted[0];
+		}
+		size_t offset = data.size();
+		Quantize(descriptor, dim, mode, data);
+		if(measureError)
+			error.Accumulate(descriptor, &data[offset], dim, mode);
+	}
+};
+
+#endif
@@ -0,0 +1,73 @@
+// Quantization test: root normalizes random descriptors laid out like the default hof + mbh rows and checks that every channel
+// comes out with unit L2 norm in float32, float16 and uint8, within what each format can represent, and that squaring the
+// dequantized values gives the channels back L1-normalized. Exits with 1 on the first mismatch.
+//
+// Usage: quantize_test
+
+#include <cstdio>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+
+#include "quantize.h"
+
+using namespace std;
+
+int main()
+{
+	// hof, mbh-x, mbh-y of 2 x 2 x 3 cells
+	vector<int> channels;
+	channels.push_back(9*12);
+	channels.push_back(8*12);
+	channels.push_back(8*12);
+	int dim = 9*12 + 2*8*12;
+	const int rows = 200;
+
+	// L2-normalized blocks per temporal cell like the extractor emits, plus a few all-zero channels
+	srand(0x9753);
+	vector<float> descriptors(rows * dim);
+	for(int i = 0; i < descriptors.size(); i++)
+		descriptors[i] = rand() % 4 == 0 ? 0 : rand() / float(RAND_MAX);
+	for(int i = 0; i < descriptors.size(); i += 8)
+	{
+		float sum = 0;
+		for(int j = i; j < i + 8; j++)
+			sum += descriptors[j] * descriptors[j];
+		for(int j = i; j < i + 8; j++)
+			descriptors[j] = sum > 0 ? descriptors[j] / sqrt(sum) : 0;
+	}
+	for(int j = 0; j < channels[1]; j++)
+		descriptors[5*dim + channels[0] + j] = 0;
+
+	OutputMode modes[] = { OutputFloat32, OutputFloat16, OutputUint8 };
+	const char* names[] = { "float32", "float16", "uint8" };
+	float tolerances[] = { 1e-5f, 2e-3f, 3e-2f };
+	for(int m = 0; m < 3; m++)
+	{
+		vector<unsigned char> quantized;
+		Quantize(&descriptors[0], descriptors.size(), modes[m], channels, quantized);
+		vector<float> restored(descriptors.size()), squared(descriptors.size());
+		Dequantize(&quantized[0], descriptors.size(), modes[m], false, &restored[0]);
+		Dequantize(&quantized[0], descriptors.size(), modes[m], true, &squared[0]);
+
+		for(int r = 0, i = 0; r < rows; r++)
+		for(int c = 0; c < channels.size(); i += channels[c], c++)
+		{
+			double l1 = 0, l2 = 0, restoredL1 = 0;
+			for(int j = i; j < i + channels[c]; j++)
+			{
+				l1 += descriptors[j];
+				l2 += restored[j] * restored[j];
+				restoredL1 += squared[j];
+			}
+			double expected = l1 > 0 ? 1 : 0;
+			if(fabs(sqrt(l2) - expected) > tolerances[m] || fabs(restoredL1 - expected) > 2*tolerances[m])
+			{
+				fprintf(stderr, "%s: row %d channel %d has L2 norm %g and squares summing to %g, expected %g\n", names[m], r, c, sqrt(l2), restoredL1, expected);
+				return 1;
+			}
+		}
+		printf("%s: ok\n", names[m]);
+	}
+	return 0;
+}
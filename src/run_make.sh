@@ -1,4 +1,9 @@
 INSTALL_DIR=/mnt/hd00/action_fixed_fps_skiing/code/mpegflow/
-c++ main.cpp -Wno-deprecated-declarations -I/usr/include/python2.7/ -o mpegflow.o -fPIC -c -D__STDC_CONSTANT_MACROS -lopencv_imgproc -lopencv_core -lswscale -lavdevice -lavformat -lavcodec -lswresample -lavutil -lpthread -lz -lc -llzma  -lboost_python -lpython2.7 -I../bin/dependencies/include -L../bin/dependencies/lib
-c++ -o mpegflow.so -shared mpegflow.o -lboost_python -lpython2.7 -lopencv_imgproc -lopencv_core -lswscale -lavdevice -lavformat -lavcodec -lswresample -lavutil -lpthread -lz -lc -llzma -I../bin/dependencies/include -L../bin/dependencies/lib
+c++ main.cpp -Wno-deprecated-declarations -I/usr/include/python2.7/ -o mpegflow.o -fPIC -c -D__STDC_CONSTANT_MACROS -lopencv_imgproc -lopencv_core -lswscale -lavdevice -lavformat -lavcodec -lswresample -lavutil -lpthread -lrt -lz -lc -llzma  -lboost_python -lpython2.7 -I../bin/dependencies/include -L../bin/dependencies/lib
+KERNEL_FLAGS="-O3 -fPIC -ffp-contract=off -fno-math-errno -fno-trapping-math"
+c++ -c kernels_generic.cpp -o kernels_generic.o $KERNEL_FLAGS
+c++ -c kernels_sse42.cpp -o kernels_sse42.o $KERNEL_FLAGS -msse4.2
+c++ -c kernels_avx2.cpp -o kernels_avx2.o $KERNEL_FLAGS -mavx2
+c++ -c kernels_avx512.cpp -o kernels_avx512.o $KERNEL_FLAGS -mavx512f
+c++ -o mpegflow.so -shared mpegflow.o kernels_generic.o kernels_sse42.o kernels_avx2.o kernels_avx512.o -lboost_python -lpython2.7 -lopencv_imgproc -lopencv_core -lswscale -lavdevice -lavformat -lavcodec -lswresample -lavutil -lpthread -lrt -lz -lc -llzma -I../bin/dependencies/include -L../bin/dependencies/lib
 cp -f mpegflow.so $INSTALL_DIR
@@ -0,0 +1,368 @@
+#include <cstring>
+#include <string>
+#include <memory>
+#include <algorithm>
+#include <stdexcept>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+
+using namespace std;
+
+#ifndef __SHM_RING_H__
+#define __SHM_RING_H__
+
+// Descriptor rows handed to other processes on the same host through a named POSIX shared-memory ring (/dev/shm/<name>),
+// so consumers read them in place instead of unpickling lists. Only depends on common.h: consumers include it on its own.
+//
+// Layout (native endianness):
+//   header, headerSize bytes:
+//     0    "MFR1"
+//     4    uint32 version (1)
+//     8    uint32 slotCount, a power of two
+//     12   uint32 dim, floats per row
+//     16   uint32 slotSize, bytes per slot, a multiple of 64
+//     20   uint32 headerSize
+//     64   uint64 writePos, rows published so far
+//     128  uint64 readPos, rows claimed by consumers so far
+//     192  uint32 closed, 1 once the producer is done
+//   slot k at headerSize + k*slotSize:
+//     0    uint64 sequence
+//     8    uint64 window, index of the window the row comes from
+//     16   float time, of that window
+//     20   int32 scale, temporal scale index (0 without temporal scales)
+//     24   int32 dim
+//     32   float row[dim]
+//
+// Sequencing (one producer, any number of consumers, every row goes to exactly one consumer): row p lives in slot p % slotCount,
+// whose sequence is p while it waits for row p, p + 1 once row p is published, and p + slotCount once its consumer released it.
+// The producer waits for sequence == p, writes the slot and stores p + 1. A consumer checks that the rows from readPos on are published,
+// claims them by a compare-and-swap of readPos, reads them in place and stores p + slotCount into each slot to hand it back.
+// Nothing is ever dropped: the producer waits while consumers lag a whole ring behind, and gives up when none frees a slot for a while.
+
+struct RingHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t slotCount;
+	uint32_t dim;
+	uint32_t slotSize;
+	uint32_t headerSize;
+	char pad0[40];
+	uint64_t writePos;
+	char pad1[56];
+	uint64_t readPos;
+	char pad2[56];
+	uint32_t closed;
+};
+
+struct RingSlot
+{
+	uint64_t sequence;
+	uint64_t window;
+	float time;
+	int32_t scale;
+	int32_t dim;
+	int32_t pad;
+
+	float* Row()
+	{
+		return (float*)(this + 1);
+	}
+};
+
+inline string RingObjectName(string name)
+{
+	return name.empty() || name[0] != '/' ? "/" + name : name;
+}
+
+inline double RingClock()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Spins a little, then yields, then sleeps, so waiting on a stalled peer doesn't burn a core
+inline void RingBackoff(int& spins)
+{
+	if(spins < 64)
+		;
+	else if(spins < 256)
+		sched_yield();
+	else
+		usleep(200);
+	spins++;
+}
+
+struct RingMapping
+{
+	void* base;
+	size_t size;
+	RingHeader* header;
+
+	RingMapping() : base(NULL), size(0), header(NULL) {}
+
+	RingSlot* Slot(uint64_t pos)
+	{
+		return (RingSlot*)((char*)base + header->headerSize + (pos & (header->slotCount - 1)) * header->slotSize);
+	}
+
+	void Unmap()
+	{
+		if(base)
+			munmap(base, size);
+		base = NULL;
+		header = NULL;
+	}
+};
+
+// Producer side. The ring is created on the first row, when its dimension is known, and replaces any stale ring of the same name.
+// Append throws when the ring stays full for timeoutSeconds, no consumer being there to drain it.
+struct SharedMemoryRingSink : DescriptorSink
+{
+	string name;
+	uint32_t slotCount;
+	double timeoutSeconds;
+	RingMapping ring;
+	uint64_t writePos;
+	uint64_t window;
+	uint64_t windows;
+	float time;
+	int scale;
+
+	SharedMemoryRingSink(string name, int slotCount, double timeoutSeconds = 30)
+		: name(RingObjectName(name)), slotCount(slotCount), timeoutSeconds(timeoutSeconds), writePos(0), window(0), windows(0), time(-1), scale(0)
+	{
+		if(slotCount < 2 || (slotCount & (slotCount - 1)) != 0)
+			throw runtime_error("The ring needs a power of two of at least 2 slots");
+	}
+
+	void Create(int dim)
+	{
+		uint32_t headerSize = 4096;
+		uint32_t slotSize = (sizeof(RingSlot) + dim*sizeof(float) + 63) / 64 * 64;
+		size_t size = headerSize + size_t(slotCount) * slotSize;
+
+		shm_unlink(name.c_str());
+		int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+		if(fd < 0)
+			throw runtime_error("Could not create shared memory ring " + name + ": " + strerror(errno));
+		void* base = ftruncate(fd, size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		close(fd);
+		if(base == MAP_FAILED)
+		{
+			shm_unlink(name.c_str());
+			throw runtime_error("Could not map shared memory ring " + name + ": " + strerror(errno));
+		}
+
+		ring.base = base;
+		ring.size = size;
+		ring.header = (RingHeader*)base;
+		RingHeader* header = ring.header;
+		header->version = 1;
+		header->slotCount = slotCount;
+		header->dim = dim;
+		header->slotSize = slotSize;
+		header->headerSize = headerSize;
+		for(uint32_t k = 0; k < slotCount; k++)
+			ring.Slot(k)->sequence = k;
+
+		// readers only trust the header once the magic is there
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy(header->magic, "MFR1", 4);
+	}
+
+	void BeginWindow(float time)
+	{
+		this->time = time;
+		window = windows++;
+	}
+
+	void SelectScale(int scale)
+	{
+		this->scale = scale;
+	}
+
+	void Append(const float* descriptor, int dim)
+	{
+		if(!ring.header)
+			Create(dim);
+		if(dim != ring.header->dim)
+			throw runtime_error("Descriptor dimension changed within a shared memory ring");
+
+		RingSlot* slot = ring.Slot(writePos);
+		double deadline = 0;
+		for(int spins = 0; __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != writePos; RingBackoff(spins))
+		{
+			// the clock is only looked at once waiting got long enough to sleep
+			if(spins < 256)
+				continue;
+			if(deadline == 0)
+				deadline = RingClock() + timeoutSeconds;
+			else if(RingClock() > deadline)
+				throw runtime_error("No consumer freed a slot of shared memory ring " + name + " in time");
+		}
+
+		slot->window = window;
+		slot->time = time;
+		slot->scale = scale;
+		slot->dim = dim;
+		memcpy(slot->Row(), descriptor, dim * sizeof(float));
+		__atomic_store_n(&slot->sequence, writePos + 1, __ATOMIC_RELEASE);
+		writePos++;
+		__atomic_store_n(&ring.header->writePos, writePos, __ATOMIC_RELEASE);
+	}
+
+	// Tells consumers no more rows are coming; an empty extraction still creates the ring so they can see that
+	void Close()
+	{
+		if(!ring.header)
+			Create(0);
+		__atomic_store_n(&ring.header->closed, 1, __ATOMIC_RELEASE);
+	}
+
+	~SharedMemoryRingSink()
+	{
+		ring.Unmap();
+	}
+};
+
+// Rows claimed by one consumer: count consecutive slots starting at slots, slotSize bytes apart
+struct RingWindow
+{
+	uint64_t first;
+	int count;
+	RingSlot* slots;
+
+	RingWindow() : first(0), count(0), slots(NULL) {}
+};
+
+// Consumer side. The ring name is removed by Unlink once everybody has opened it; open mappings stay valid after that.
+// The mapping goes away with the last holder of mapped, which may outlive the reader.
+struct SharedMemoryRingReader
+{
+	string name;
+	RingMapping ring;
+	std::shared_ptr<void> mapped;
+
+	// Waits up to timeoutSeconds for the producer to create the ring
+	SharedMemoryRingReader(string name, double timeoutSeconds = 10) : name(RingObjectName(name))
+	{
+		double deadline = RingClock() + timeoutSeconds;
+		for(int spins = 0; !TryOpen(); RingBackoff(spins))
+		{
+			if(RingClock() > deadline)
+				throw runtime_error("No shared memory ring " + this->name);
+		}
+	}
+
+	bool TryOpen()
+	{
+		int fd = shm_open(name.c_str(), O_RDWR, 0);
+		if(fd < 0)
+			return false;
+		struct stat st;
+		void* base = fstat(fd, &st) == 0 && st.st_size >= 4096 ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+		close(fd);
+		if(base == MAP_FAILED)
+			return false;
+
+		RingHeader* header = (RingHeader*)base;
+		if(memcmp(header->magic, "MFR1", 4) != 0)
+		{
+			munmap(base, st.st_size);
+			return false;
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(header->version != 1 || header->headerSize + size_t(header->slotCount) * header->slotSize > size_t(st.st_size))
+		{
+			munmap(base, st.st_size);
+			throw runtime_error("Not a descriptor ring: " + name);
+		}
+		ring.base = base;
+		ring.size = st.st_size;
+		ring.header = header;
+		size_t size = st.st_size;
+		mapped = std::shared_ptr<void>(base, [size](void* base) { munmap(base, size); });
+		return true;
+	}
+
+	int Dim()
+	{
+		return ring.header->dim;
+	}
+
+	int SlotSize()
+	{
+		return ring.header->slotSize;
+	}
+
+	// No more rows: the producer closed the ring and every row has been claimed
+	bool Finished()
+	{
+		return __atomic_load_n(&ring.header->closed, __ATOMIC_ACQUIRE)
+			&& __atomic_load_n(&ring.header->readPos, __ATOMIC_ACQUIRE) >= __atomic_load_n(&ring.header->writePos, __ATOMIC_ACQUIRE);
+	}
+
+	// Claims up to maxRows published rows, contiguous in memory (a claim stops at the end of the ring). The count is 0 when
+	// no row came within timeoutSeconds or the ring is finished. The rows stay valid until they're released.
+	RingWindow Claim(int maxRows, double timeoutSeconds)
+	{
+		RingHeader* header = ring.header;
+		double deadline = RingClock() + timeoutSeconds;
+		for(int spins = 0; ; )
+		{
+			uint64_t pos = __atomic_load_n(&header->readPos, __ATOMIC_ACQUIRE);
+			uint64_t limit = std::min<uint64_t>(std::max(maxRows, 1), header->slotCount - (pos & (header->slotCount - 1)));
+			uint64_t count = 0;
+			while(count < limit && __atomic_load_n(&ring.Slot(pos + count)->sequence, __ATOMIC_ACQUIRE) == pos + count + 1)
+				count++;
+
+			if(count > 0)
+			{
+				if(__atomic_compare_exchange_n(&header->readPos, &pos, pos + count, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+				{
+					RingWindow window;
+					window.first = pos;
+					window.count = count;
+					window.slots = ring.Slot(pos);
+					return window;
+				}
+				// another consumer got there first, look again right away
+				continue;
+			}
+
+			if(Finished() || RingClock() > deadline)
+				return RingWindow();
+			RingBackoff(spins);
+		}
+	}
+
+	// Hands the slots back to the producer
+	void Release(RingWindow& window)
+	{
+		for(int i = 0; i < window.count; i++)
+			__atomic_store_n(&ring.Slot(window.first + i)->sequence, window.first + i + ring.header->slotCount, __ATOMIC_RELEASE);
+		window = RingWindow();
+	}
+
+	RingSlot* SlotOf(RingWindow& window, int i)
+	{
+		return (RingSlot*)((char*)window.slots + size_t(i) * ring.header->slotSize);
+	}
+
+	void Unlink()
+	{
+		shm_unlink(name.c_str());
+	}
+};
+
+#endif
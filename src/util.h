@@ -1,6 +1,7 @@
 #include <cstdio>
 #include <cstdlib>
 #include <string>
+#include <map>
 #include <opencv/cv.h>
 
 #ifndef __UTIL_H__
@@ -35,6 +36,52 @@ struct Timer
 	}
 };
 
+// counters of the last extraction, exposed to python through get_stats
+struct ExtractionStats
+{
+	int EmittedPatches;
+	int PrunedPatches;
+	std::map<char, int> SampledFrames; // per picture type
+	int SkippedFrames;
+	int DescriptorDim;
+	double QuantizationMeanAbsError;
+	double QuantizationMaxAbsError;
+	std::string CpuLevel; // kernel level the descriptors were computed with
+	int LatencyWindows; // live mode: windows emitted, with their latency from packet arrival to emission
+	double LatencySumMs;
+	double MaxLatencyMs;
+	double LagSeconds; // live mode: how far behind the stream clock the reader was at the last window, and at worst
+	double MaxLagSeconds;
+	long long BytesRead; // from the input, container overhead included
+	double IoMs; // spent in the storage protocol, only measured with our own I/O buffer
+	double ReadStallMs; // decoding waited on the demuxer, or on the read-ahead queue
+
+	ExtractionStats() : EmittedPatches(0), PrunedPatches(0), SkippedFrames(0), DescriptorDim(0), QuantizationMeanAbsError(0), QuantizationMaxAbsError(0),
+		LatencyWindows(0), LatencySumMs(0), MaxLatencyMs(0), LagSeconds(0), MaxLagSeconds(0), BytesRead(0), IoMs(0), ReadStallMs(0) {}
+
+	void RecordLatency(double ms, double lagSeconds)
+	{
+		LatencyWindows++;
+		LatencySumMs += ms;
+		MaxLatencyMs = std::max(MaxLatencyMs, ms);
+		LagSeconds = lagSeconds;
+		MaxLagSeconds = std::max(MaxLagSeconds, lagSeconds);
+	}
+
+	double MeanLatencyMs()
+	{
+		return LatencyWindows > 0 ? LatencySumMs / LatencyWindows : 0;
+	}
+
+	int ProcessedFrames()
+	{
+		int total = 0;
+		for(std::map<char, int>::iterator it = SampledFrames.begin(); it != SampledFrames.end(); ++it)
+			total += it->second;
+		return total;
+	}
+};
+
 void log(const char* fmt, ...)
 {
 	FILE* out = stderr;
@@ -23,14 +23,27 @@
 extern "C"{
 #include <libavcodec/avcodec.h>
 #include <libavutil/motion_vector.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
 #include <libavformat/avformat.h>
 }
 #include <string>
+#include <vector>
+#include <stdexcept>
+#include <deque>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "common.h"
 #include <opencv/cv.h>
 #include <opencv/cxcore.h>
 using namespace cv;
 
+#ifndef __FRAME_READER_H__
+#define __FRAME_READER_H__
+
 struct MotionVector
 {
 	int X,Y;
@@ -52,8 +65,156 @@ struct MotionVector
 	}
 };
 
-#ifndef __FRAME_READER_H__
-#define __FRAME_READER_H__
+enum SamplingPolicy
+{
+	SampleAllFrames, // decode and return every frame
+	SampleSkipBidir, // the decoder discards B-frames
+	SampleSkipNonRef, // the decoder discards all non-reference frames
+	SampleEveryKthP // B-frames are discarded and only every k-th P-frame is returned
+};
+
+// Opened decoders keyed by codec parameters, so that a run over many short clips opens each kind of decoder once and only
+// flushes it between files. Not thread-safe: every worker keeps its own pool.
+struct DecoderPool
+{
+	static const int maxIdle = 8;
+	std::vector<std::pair<std::string, AVCodecContext*> > idle;
+	int Opened, Reused;
+
+	DecoderPool() : Opened(0), Reused(0)
+	{
+	}
+
+	// Decoders are interchangeable when codec, picture format and extradata (SPS/PPS and the like) all match
+	static std::string KeyFor(const AVCodecParameters* par)
+	{
+		// no pixel format: a fast open doesn't know it yet, and the decoder takes it from the bitstream anyway
+		int fields[] = { par->codec_id, par->width, par->height, par->profile, par->level };
+		std::string key((const char*)fields, sizeof(fields));
+		if (par->extradata_size > 0)
+			key.append((const char*)par->extradata, par->extradata_size);
+		return key;
+	}
+
+	AVCodecContext* Acquire(const std::string& key)
+	{
+		for (int i = idle.size() - 1; i >= 0; i--) {
+			if (idle[i].first == key) {
+				AVCodecContext* ctx = idle[i].second;
+				idle.erase(idle.begin() + i);
+				avcodec_flush_buffers(ctx);
+				ctx->skip_frame = AVDISCARD_DEFAULT;
+				Reused++;
+				return ctx;
+			}
+		}
+		return NULL;
+	}
+
+	void Release(const std::string& key, AVCodecContext* ctx)
+	{
+		if (idle.size() >= maxIdle) {
+			avcodec_free_context(&idle.front().second);
+			idle.erase(idle.begin());
+		}
+		idle.push_back(std::make_pair(key, ctx));
+	}
+
+	~DecoderPool()
+	{
+		for (int i = 0; i < idle.size(); i++)
+			avcodec_free_context(&idle[i].second);
+	}
+};
+
+void RegisterCodecsOnce()
+{
+	// a function-local static is initialized exactly once, even with several threads opening files
+	static bool registered = (av_register_all(), true);
+	(void)registered;
+}
+
+// Container headers are enough to skip the stream info probe when they already give the codec, picture size and format, and a frame rate
+bool HasSufficientHeaders(AVFormatContext *fmt_ctx)
+{
+	int stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	if (stream_idx < 0)
+		return false;
+	AVStream *st = fmt_ctx->streams[stream_idx];
+	AVCodecParameters *par = st->codecpar;
+	// the pixel format isn't required: mov/mp4 leave it unset until frames are probed, and the decoder finds it on its own
+	return par->codec_id != AV_CODEC_ID_NONE && par->width > 0 && par->height > 0
+		&& (st->r_frame_rate.num > 0 || st->avg_frame_rate.num > 0);
+}
+
+// Reads the input through our own AVIO context on top of the protocol's: one large buffer, so slow (network-mounted) storage sees
+// few big reads instead of many 32 KiB ones, and every byte and microsecond spent in the protocol gets counted.
+// The counters are atomic because a read-ahead thread drives the reads when it runs.
+struct BufferedInput
+{
+	AVIOContext *inner;
+	AVIOContext *outer;
+	std::atomic<int64_t> BytesRead;
+	std::atomic<int64_t> IoMicroseconds;
+
+	BufferedInput() : inner(NULL), outer(NULL), BytesRead(0), IoMicroseconds(0)
+	{
+	}
+
+	static int ReadPacket(void *opaque, uint8_t *buf, int size)
+	{
+		BufferedInput *in = (BufferedInput*)opaque;
+		int64_t begin = av_gettime_relative();
+		int ret = avio_read(in->inner, buf, size);
+		in->IoMicroseconds += av_gettime_relative() - begin;
+		if (ret > 0)
+			in->BytesRead += ret;
+		return ret == 0 ? AVERROR_EOF : ret;
+	}
+
+	static int64_t Seek(void *opaque, int64_t offset, int whence)
+	{
+		BufferedInput *in = (BufferedInput*)opaque;
+		if (whence & AVSEEK_SIZE)
+			return avio_size(in->inner);
+		return avio_seek(in->inner, offset, whence & ~AVSEEK_FORCE);
+	}
+
+	// Sets fmt_ctx->pb up for avformat_open_input; false if the url can't be opened
+	bool Open(const char *url, int bufferSize, AVFormatContext *fmt_ctx)
+	{
+		if (avio_open2(&inner, url, AVIO_FLAG_READ, NULL, NULL) < 0)
+			return false;
+		unsigned char *buffer = (unsigned char*)av_malloc(bufferSize);
+		outer = buffer ? avio_alloc_context(buffer, bufferSize, 0, this, ReadPacket, NULL, Seek) : NULL;
+		if (!outer) {
+			av_free(buffer);
+			avio_closep(&inner);
+			return false;
+		}
+		outer->seekable = inner->seekable;
+		fmt_ctx->pb = outer;
+		return true;
+	}
+
+	// after avformat_close_input, which leaves custom contexts alone
+	void Close()
+	{
+		if (outer) {
+			av_freep(&outer->buffer);
+			avio_context_free(&outer);
+		}
+		avio_closep(&inner);
+	}
+};
+
+// What a live reader discards at the decoder while it lags behind the stream clock
+enum LiveDropPolicy
+{
+	DropNone, // never drop, latency grows without bound under backpressure
+	DropBidir, // discard B-frames until caught up
+	DropNonKey // discard everything but keyframes until caught up
+};
 
 struct FrameReader
 {
@@ -76,8 +237,40 @@ struct FrameReader
 	float fps, frameScale;
 	int timeBase;
 	int frameCount;	
+	SamplingPolicy sampling;
+	int samplingK;
+	int pFrameCounter;
+	int64_t lastSampledPTS;
+	double ptsPerFrame;
+	bool appearance;
+	bool live;
+	LiveDropPolicy dropPolicy;
+	float maxLag;
+	float Lag; // live: seconds the reader is behind the stream clock
+	int64_t firstArrival;
+	float firstTime;
+	AVDiscard samplingDiscard;
+	DecoderPool *pool;
+	std::string decoderKey;
+	bool FastOpened; // the stream info probe was skipped
+	BufferedInput input; // unused when the demuxer does its own I/O
+	int64_t readStallMicroseconds; // decoding waited this long for packets
+	std::thread prefetcher;
+	std::mutex queueMutex;
+	std::condition_variable queueNotEmpty, queueNotFull;
+	std::deque<AVPacket*> queue;
+	std::deque<int64_t> queueArrivals; // when each queued packet came out of the demuxer
+	int64_t packetArrival; // same for pkt
+	int readAheadPackets;
+	bool prefetchDone, stopPrefetch;
 	const char *src_filename = NULL;
-	FrameReader(const char *videoPath)
+
+	static const int defaultIoBufferSize = 1 << 20;
+
+	// A live source (pipe, FIFO, network url) is opened with a small probe and never assumed to have a known length.
+	// With a pool the decoder comes from and goes back to it, and the open is quiet and skips probing when headers suffice.
+	// Files are read through an ioBufferSize bytes buffer, 0 leaves I/O to the demuxer; live sources always do their own.
+	FrameReader(const char *videoPath, bool live = false, DecoderPool *pool = NULL, int ioBufferSize = defaultIoBufferSize)
 	{
 	
 	fmt_ctx = NULL;
@@ -87,36 +280,63 @@ struct FrameReader
 	time = -1.;
 	video_stream_idx = -1;
 	video_frame_count = 0;
+	sampling = SampleAllFrames;
+	samplingK = 1;
+	pFrameCounter = 0;
+	lastSampledPTS = AV_NOPTS_VALUE;
+	appearance = false;
+	this->live = live;
+	dropPolicy = DropNone;
+	maxLag = 0;
+	Lag = 0;
+	firstArrival = AV_NOPTS_VALUE;
+	firstTime = 0;
+	samplingDiscard = AVDISCARD_DEFAULT;
+	this->pool = pool;
+	FastOpened = false;
+	readStallMicroseconds = 0;
+	readAheadPackets = 0;
+	packetArrival = 0;
+	prefetchDone = stopPrefetch = false;
 	src_filename = videoPath;
 	
-	av_register_all();
-	if (avformat_open_input(&fmt_ctx, src_filename, NULL, NULL) < 0) {
-		fprintf(stderr, "Could not open source file %s\n", src_filename);
-		exit(1);
+	RegisterCodecsOnce();
+	AVDictionary *format_opts = NULL;
+	if (live) {
+		avformat_network_init();
+		av_dict_set(&format_opts, "probesize", "32768", 0);
+		av_dict_set(&format_opts, "analyzeduration", "500000", 0);
+		av_dict_set(&format_opts, "fflags", "nobuffer", 0);
 	}
-
-        if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
-		fprintf(stderr, "Could not find stream information\n");
-		exit(1);
+	if (!live && ioBufferSize > 0) {
+		fmt_ctx = avformat_alloc_context();
+		if (!fmt_ctx || !input.Open(src_filename, ioBufferSize, fmt_ctx))
+			Fail(std::string("Could not open source file ") + src_filename);
 	}
+	ret = avformat_open_input(&fmt_ctx, src_filename, NULL, &format_opts);
+	av_dict_free(&format_opts);
+	if (ret < 0)
+		Fail(std::string("Could not open source file ") + src_filename);
+
+	FastOpened = pool && !live && HasSufficientHeaders(fmt_ctx);
+        if (!FastOpened && avformat_find_stream_info(fmt_ctx, NULL) < 0)
+		Fail(std::string("Could not find stream information in ") + src_filename);
 
 	open_codec_context(fmt_ctx, AVMEDIA_TYPE_VIDEO);
-	av_dump_format(fmt_ctx, 0, src_filename, 0);
+	if (!live && !pool)
+		av_dump_format(fmt_ctx, 0, src_filename, 0);
 
-	if (!video_stream) {
-	fprintf(stderr, "Could not find video stream in the input, aborting\n");
-	ret = 1;
-	release();
-	exit(1);
-	}
+	if (!video_stream)
+		Fail(std::string("Could not find video stream in ") + src_filename);
+
+	// the demuxer skips the payload of discarded streams instead of reading it only for us to drop the packets
+	for (unsigned int i = 0; i < fmt_ctx->nb_streams; i++)
+		if (i != video_stream_idx)
+			fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
 
 	frame = av_frame_alloc();
-	if (!frame) {
-	fprintf(stderr, "Could not allocate frame\n");
-	ret = AVERROR(ENOMEM);
-	release();
-	exit(1);
-	}
+	if (!frame)
+		Fail("Could not allocate frame");
 
 
 	int cols = video_dec_ctx->width;
@@ -125,10 +345,15 @@ struct FrameReader
 	height = video_dec_ctx->height;
 	frameCount = video_stream->nb_frames;
 	frameScale = av_q2d (video_stream->time_base);
-	fps = av_q2d(video_stream->r_frame_rate);
+	fps = video_stream->r_frame_rate.num > 0 ? av_q2d(video_stream->r_frame_rate) : av_q2d(video_stream->avg_frame_rate);
+	ptsPerFrame = fps > 0 ? 1 / (fps * frameScale) : 0;
 	timeBase = (int64_t(video_dec_ctx->time_base.num) * AV_TIME_BASE) / int64_t(video_dec_ctx->time_base.den);
 
-	if(frameCount == 0)
+	if(live)
+	{
+		frameCount = 0;
+	}
+	else if(frameCount == 0)
 	{
 		frameCount = (double)video_stream->duration * frameScale;
 	}
@@ -154,6 +379,17 @@ struct FrameReader
 		int stream_idx = ret;
 		st = fmt_ctx->streams[stream_idx];
 
+		if (pool) {
+		    decoderKey = DecoderPool::KeyFor(st->codecpar);
+		    dec_ctx = pool->Acquire(decoderKey);
+		    if (dec_ctx) {
+			video_stream_idx = stream_idx;
+			video_stream = st;
+			video_dec_ctx = dec_ctx;
+			return 0;
+		    }
+		}
+
 		dec_ctx = avcodec_alloc_context3(dec);
 		if (!dec_ctx) {
 		    fprintf(stderr, "Failed to allocate codec\n");
@@ -163,6 +399,7 @@ struct FrameReader
 		ret = avcodec_parameters_to_context(dec_ctx, st->codecpar);
 		if (ret < 0) {
 		    fprintf(stderr, "Failed to copy codec parameters to codec context\n");
+		    avcodec_free_context(&dec_ctx);
 		    return ret;
 		}
 
@@ -171,17 +408,212 @@ struct FrameReader
 		if ((ret = avcodec_open2(dec_ctx, dec, &opts)) < 0) {
 		    fprintf(stderr, "Failed to open %s codec\n",
 			    av_get_media_type_string(type));
+		    avcodec_free_context(&dec_ctx);
 		    return ret;
 		}
 
 		video_stream_idx = stream_idx;
 		video_stream = fmt_ctx->streams[video_stream_idx];
 		video_dec_ctx = dec_ctx;
+		if (pool)
+		    pool->Opened++;
 	    }
 
 	    return 0;
 	}
 
+	// A thread demuxes up to packets video packets ahead of the decoder, so reads overlap with decoding
+	void StartReadAhead(int packets)
+	{
+		if (packets <= 0 || prefetcher.joinable())
+			return;
+		readAheadPackets = packets;
+		prefetchDone = stopPrefetch = false;
+		prefetcher = std::thread(&FrameReader::PrefetchPackets, this);
+	}
+
+	void PrefetchPackets()
+	{
+		while (true) {
+			AVPacket *p = av_packet_alloc();
+			bool ok = p && av_read_frame(fmt_ctx, p) >= 0;
+			int64_t arrival = av_gettime_relative();
+			if (ok && p->stream_index != video_stream_idx) {
+				av_packet_free(&p);
+				continue;
+			}
+
+			std::unique_lock<std::mutex> lock(queueMutex);
+			if (ok)
+				queueNotFull.wait(lock, [this] { return stopPrefetch || queue.size() < readAheadPackets; });
+			if (!ok || stopPrefetch) {
+				av_packet_free(&p);
+				prefetchDone = true;
+				queueNotEmpty.notify_one();
+				return;
+			}
+			queue.push_back(p);
+			queueArrivals.push_back(arrival);
+			queueNotEmpty.notify_one();
+		}
+	}
+
+	// Joins the read-ahead thread and drops what it had queued, the demuxer is ours again afterwards
+	void StopReadAhead()
+	{
+		if (!prefetcher.joinable())
+			return;
+		{
+			std::lock_guard<std::mutex> lock(queueMutex);
+			stopPrefetch = true;
+		}
+		queueNotFull.notify_one();
+		prefetcher.join();
+		for (int i = 0; i < queue.size(); i++)
+			av_packet_free(&queue[i]);
+		queue.clear();
+		queueArrivals.clear();
+	}
+
+	// Next packet into pkt, from the read-ahead queue when there is one; false at the end of the input.
+	// packetArrival is when the demuxer handed it over, so packets waiting in the queue count towards live latency.
+	bool NextPacket()
+	{
+		int64_t begin = av_gettime_relative();
+		bool ok;
+		if (prefetcher.joinable()) {
+			std::unique_lock<std::mutex> lock(queueMutex);
+			queueNotEmpty.wait(lock, [this] { return !queue.empty() || prefetchDone; });
+			ok = !queue.empty();
+			if (ok) {
+				AVPacket *p = queue.front();
+				queue.pop_front();
+				packetArrival = queueArrivals.front();
+				queueArrivals.pop_front();
+				queueNotFull.notify_one();
+				lock.unlock();
+				av_packet_move_ref(&pkt, p);
+				av_packet_free(&p);
+			}
+		}
+		else {
+			ok = av_read_frame(fmt_ctx, &pkt) >= 0;
+			packetArrival = av_gettime_relative();
+		}
+		readStallMicroseconds += av_gettime_relative() - begin;
+		return ok;
+	}
+
+	// Repositions on the last keyframe at or before seconds and drops decoder state, so the next Read decodes cleanly from there.
+	// A failed seek leaves the position alone, reading on forward still gets there.
+	bool SeekBackTo(double seconds)
+	{
+		bool prefetching = prefetcher.joinable();
+		StopReadAhead();
+		int64_t ts = int64_t(seconds / frameScale);
+		bool ok = av_seek_frame(fmt_ctx, video_stream_idx, ts, AVSEEK_FLAG_BACKWARD) >= 0;
+		if (ok) {
+			avcodec_flush_buffers(video_dec_ctx);
+			lastSampledPTS = AV_NOPTS_VALUE;
+			pFrameCounter = 0;
+		}
+		if (prefetching)
+			StartReadAhead(readAheadPackets);
+		return ok;
+	}
+
+	int64_t BytesRead()
+	{
+		return input.outer ? input.BytesRead.load() : (fmt_ctx && fmt_ctx->pb ? fmt_ctx->pb->bytes_read : 0);
+	}
+
+	// Discarding at the decoder level means skipped frames are never decoded at all, not just dropped after decoding
+	void SetSamplingPolicy(SamplingPolicy policy, int k = 1)
+	{
+		sampling = policy;
+		samplingK = max(1, k);
+		pFrameCounter = 0;
+
+		if(policy == SampleSkipBidir || policy == SampleEveryKthP)
+			samplingDiscard = AVDISCARD_BIDIR;
+		else if(policy == SampleSkipNonRef)
+			samplingDiscard = AVDISCARD_NONREF;
+		else
+			samplingDiscard = AVDISCARD_DEFAULT;
+		video_dec_ctx->skip_frame = samplingDiscard;
+	}
+
+	void SetLiveDropPolicy(LiveDropPolicy policy, float maxLagSeconds)
+	{
+		dropPolicy = policy;
+		maxLag = maxLagSeconds;
+	}
+
+	// Lag is wall time since the first frame minus stream time since the first frame; sources faster than real time never lag
+	void UpdateLag()
+	{
+		int64_t now = av_gettime_relative();
+		if (firstArrival == AV_NOPTS_VALUE) {
+			firstArrival = now;
+			firstTime = time;
+			return;
+		}
+		Lag = (now - firstArrival) / 1e6 - (time - firstTime);
+
+		AVDiscard discard = samplingDiscard;
+		if (dropPolicy != DropNone && Lag > maxLag)
+			discard = max(discard, dropPolicy == DropBidir ? AVDISCARD_BIDIR : AVDISCARD_NONKEY);
+		video_dec_ctx->skip_frame = discard;
+	}
+
+	bool IsSampled(const AVFrame* frame)
+	{
+		if(sampling == SampleEveryKthP && frame->pict_type == AV_PICTURE_TYPE_P)
+			return pFrameCounter++ % samplingK == 0;
+		return true;
+	}
+
+	// With appearance enabled every returned frame carries RawImage: the luma plane area-averaged straight down to the
+	// motion vector grid, so HOG never needs a full-resolution BGR conversion
+	void SetAppearanceEnabled(bool enabled)
+	{
+		appearance = enabled;
+	}
+
+	// Averages every gridStep x gridStep block of the 8-bit luma plane into one pixel of an 8-bit grid image;
+	// formats without such a plane (RGB, palette, high bit depth, hardware) leave it empty
+	void ExtractLumaGrid(const AVFrame* frame, Mat& dst)
+	{
+		const AVPixFmtDescriptor* desc = av_pix_fmt_desc_get((AVPixelFormat)frame->format);
+		if(!desc || (desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_HWACCEL))
+			|| desc->comp[0].depth != 8 || desc->comp[0].step != 1)
+			return;
+
+		int gridWidth = min(DownsampledFrameSize.width, frame->width / gridStep);
+		int gridHeight = min(DownsampledFrameSize.height, frame->height / gridStep);
+		dst = Mat::zeros(DownsampledFrameSize, CV_8U);
+		std::vector<unsigned int> rowSums(gridWidth);
+		for(int i = 0; i < gridHeight; i++)
+		{
+			std::fill(rowSums.begin(), rowSums.end(), 0);
+			for(int y = i*gridStep; y < (i+1)*gridStep; y++)
+			{
+				const uint8_t* luma = frame->data[0] + y*frame->linesize[0];
+				for(int j = 0; j < gridWidth; j++)
+				{
+					unsigned int sum = 0;
+					for(int x = 0; x < gridStep; x++)
+						sum += luma[j*gridStep + x];
+					rowSums[j] += sum;
+				}
+			}
+
+			uint8_t* out = dst.ptr<uint8_t>(i);
+			for(int j = 0; j < gridWidth; j++)
+				out[j] = (rowSums[j] + gridStep*gridStep/2) / (gridStep*gridStep);
+		}
+	}
+
 	void PutMotionVectorInMatrix(MotionVector& mv, Frame& f)
 	{
 		f.width = width;
@@ -200,6 +632,8 @@ struct FrameReader
 		{
 			f.Dx(i_16, j_16) = mv.Dx;
 			f.Dy(i_16, j_16) = mv.Dy;
+			// may count a cell twice or miss that a later vector zeroed it, but stays 0 only for an all-zero field
+			f.MotionCells += mv.Dx != 0 || mv.Dy != 0;
 		}
 	}
 
@@ -242,7 +676,21 @@ struct FrameReader
 		    AVFrameSideData *sd;
 
 		    video_frame_count++;
+		    if (!IsSampled(frame)) {
+			av_frame_unref(frame);
+			continue;
+		    }
 		    found = true;
+		    f.PictType = av_get_picture_type_char(frame->pict_type);
+
+		    int64_t pts = frame->best_effort_timestamp;
+		    if ((sampling != SampleAllFrames || live) && pts != AV_NOPTS_VALUE && lastSampledPTS != AV_NOPTS_VALUE && ptsPerFrame > 0)
+			f.FrameSpan = max(1, cvRound((pts - lastSampledPTS) / ptsPerFrame));
+		    lastSampledPTS = pts;
+
+		    if (appearance)
+			ExtractLumaGrid(frame, f.RawImage);
+
 		    sd = av_frame_get_side_data(frame, AV_FRAME_DATA_MOTION_VECTORS);
 		    if (sd) {
 			MotionVector mv_;
@@ -262,9 +710,22 @@ struct FrameReader
 
 
 
+	// Frees what was opened so far and hands the error to the caller, which may well go on with other videos
+	void Fail(std::string message)
+	{
+		release();
+		throw std::runtime_error(message);
+	}
+
 	void release(){
+	    StopReadAhead();
+	    if (pool && video_dec_ctx) {
+		pool->Release(decoderKey, video_dec_ctx);
+		video_dec_ctx = NULL;
+	    }
 	    avcodec_free_context(&video_dec_ctx);
 	    avformat_close_input(&fmt_ctx);
+	    input.Close();
 	    av_frame_free(&frame);
 	}
 
@@ -272,13 +733,15 @@ struct FrameReader
 	Frame Read(){
 		
 		Frame fr(video_frame_count, Mat_<float>::zeros(DownsampledFrameSize), Mat_<float>::zeros(DownsampledFrameSize), Mat_<bool>::zeros(DownsampledFrameSize));
+		fr.MotionCells = 0;
 		bool found = false;
 		int ret = 0;
 		found = false;
 		
-		while (!found && av_read_frame(fmt_ctx, &pkt) >= 0) {
+		while (!found && NextPacket()) {
 			
         		if (pkt.stream_index == video_stream_idx){
+				fr.ArrivalTime = packetArrival;
             	 		ret = decode_packet(&pkt, fr, found);
 				time = (float)pkt.dts*frameScale;
 			
@@ -286,6 +749,10 @@ struct FrameReader
 			fr.PTS=pkt.pts;	
         		av_packet_unref(&pkt);
         	}
+		if (live && found) {
+			UpdateLag();
+			fr.Lag = Lag;
+		}
 		if (ret < 0){
 			fr.PTS = -1;
 		}
@@ -300,17 +767,46 @@ struct FrameReader
 	}
 };
 
-
-#endif
-
 int open_file(const char *src_filename){
 
 	AVFormatContext *fmt_ctx = NULL;
-	av_register_all();
+	RegisterCodecsOnce();
 	if (avformat_open_input(&fmt_ctx, src_filename, NULL, NULL) < 0) {
 	return 1;
 	}
 	else{
+	avformat_close_input(&fmt_ctx);
 	return 0;
 	}
 }
+
+// Frame count from the container headers without opening a decoder, falling back to duration times frame rate; false if the file can't be probed
+bool probe_frame_count(const char *src_filename, int &frameCount){
+
+	AVFormatContext *fmt_ctx = NULL;
+	RegisterCodecsOnce();
+	if (avformat_open_input(&fmt_ctx, src_filename, NULL, NULL) < 0) {
+	return false;
+	}
+	if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+	avformat_close_input(&fmt_ctx);
+	return false;
+	}
+
+	int stream_idx = av_find_best_stream(fmt_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+	if (stream_idx < 0) {
+	avformat_close_input(&fmt_ctx);
+	return false;
+	}
+
+	AVStream *st = fmt_ctx->streams[stream_idx];
+	frameCount = st->nb_frames;
+	if(frameCount == 0)
+	{
+		frameCount = (double)st->duration * av_q2d(st->time_base) * av_q2d(st->r_frame_rate);
+	}
+	avformat_close_input(&fmt_ctx);
+	return true;
+}
+
+#endif